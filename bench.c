@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "startup.h"
+#include "stats.h"
+
+/* a case that has not finished by then is killed and reported as such */
+#define BENCH_TIMEOUT 120
+
+static int result_fd = -1;
+
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if ((unsigned char) *s >= 0x20)
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static double tv_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* The child's own chatter would corrupt the JSON on stdout */
+static void silence_stdout(void)
+{
+	int null_fd;
+
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd >= 0) {
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+}
+
+static size_t read_result(int fd, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t r;
+
+	while (len < size - 1) {
+		r = read(fd, buf + len, size - 1 - len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		len += r;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+const struct bench_case *bench_run(const struct bench_case *cases,
+		int n_cases, const char *dev_name, long frames)
+{
+	char result[4096];
+	struct rusage ru;
+	int pfd[2];
+	int status;
+	pid_t pid;
+	int i;
+
+	printf("{\n  \"device\": ");
+	json_string(stdout, dev_name);
+	printf(",\n  \"frames\": %ld,\n  \"runs\": [", frames);
+
+	for (i = 0; i < n_cases; i++) {
+		if (pipe(pfd) < 0) {
+			perror("pipe");
+			exit(EXIT_FAILURE);
+		}
+
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pid == 0) {
+			/* each case measures its own cold start */
+			startup_begin();
+			close(pfd[0]);
+			result_fd = pfd[1];
+			silence_stdout();
+			alarm(BENCH_TIMEOUT);
+			return &cases[i];
+		}
+
+		close(pfd[1]);
+		read_result(pfd[0], result, sizeof(result));
+		close(pfd[0]);
+
+		while (wait4(pid, &status, 0, &ru) < 0) {
+			if (errno != EINTR) {
+				perror("wait4");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		printf("%s\n    {\"io\": \"%s\", \"ui\": \"%s\", ",
+			i ? "," : "", cases[i].io_name, cases[i].ui);
+		if (WIFEXITED(status))
+			printf("\"exit_status\": %d, ", WEXITSTATUS(status));
+		else
+			printf("\"signal\": %d, ", WTERMSIG(status));
+		printf("\"user_s\": %.3f, \"sys_s\": %.3f, \"max_rss_kb\": %ld",
+			tv_seconds(&ru.ru_utime), tv_seconds(&ru.ru_stime),
+			ru.ru_maxrss);
+		if (result[0])
+			printf(", %s", result);
+		printf("}");
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fprintf(stderr, "bench: %s/%s failed\n",
+				cases[i].io_name, cases[i].ui);
+	}
+
+	printf("\n  ]\n}\n");
+	fflush(stdout);
+	return NULL;
+}
+
+void bench_report(long frames, double seconds, unsigned long ring_dropped)
+{
+	FILE *fp;
+
+	if (result_fd < 0)
+		return;
+
+	fp = fdopen(result_fd, "w");
+	if (!fp)
+		return;
+
+	fprintf(fp, "\"fps\": %.2f, \"seconds\": %.3f, \"frames_timed\": %ld, ",
+		seconds > 0 ? frames / seconds : 0.0, seconds, frames);
+	stats_report_json(fp, ring_dropped);
+	fclose(fp);
+	result_fd = -1;
+}
@@ -0,0 +1,25 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * --bench: every I/O method and UI combination runs in a child process of
+ * its own, so each starts from a freshly opened device and its rusage and
+ * peak RSS are its own. The parent collects what the children report and
+ * prints one JSON document on stdout.
+ */
+
+struct bench_case {
+	int             io;
+	const char      *io_name;
+	const char      *ui;
+};
+
+/* Returns in each child with the case it has to run, and NULL in the
+parent once all cases finished and the results were printed */
+const struct bench_case *bench_run(const struct bench_case *cases,
+		int n_cases, const char *dev_name, long frames);
+
+/* Child side, after the last frame */
+void bench_report(long frames, double seconds, unsigned long ring_dropped);
+
+#endif // BENCH_H
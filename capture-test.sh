@@ -0,0 +1,20 @@
+#!/bin/sh
+# Captures from the synthetic device with every I/O method. Streaming that
+# never starts shows up as a hang, which the timeout turns into a failure.
+
+svv=${SVV:-./svv}
+XDG_CACHE_HOME=$(mktemp -d) || exit 1
+export XDG_CACHE_HOME
+status=0
+
+for io in r m u; do
+	if timeout 30 "$svv" -d synth@60 -u none -n 30 -m $io >/dev/null; then
+		echo "-m $io: ok"
+	else
+		echo "-m $io: FAIL"
+		status=1
+	fi
+done
+
+rm -rf "$XDG_CACHE_HOME"
+exit $status
@@ -0,0 +1,294 @@
+/*
+ * Runs every conversion kernel compiled in and supported by the CPU
+ * against the scalar one, on widths around each kernel's block size and
+ * on 1080p frames, and checks they are bit exact and write nothing past
+ * the end of their output. With --bench it times each kernel instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <linux/videodev2.h>
+
+#include "convert.h"
+
+#define FULL_W 1920
+#define FULL_H 1080
+#define MAX_TAIL 130		/* past two AVX2 blocks of 64 pixels */
+#define GUARD 64		/* bytes after each output that must not change */
+#define BENCH_NS 200000000ULL	/* per kernel and test */
+
+static const char *kernels[] = { "scalar", "ssse3", "avx2" };
+
+static const unsigned int yuv_formats[] = {
+	V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_NV12,
+};
+
+static unsigned char *src;
+static unsigned char *ref;
+static unsigned char *out;
+static int failures;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_random(unsigned char *p, size_t n)
+{
+	uint32_t x = 2463534242u;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		p[i] = x;
+	}
+}
+
+static void *xmalloc(size_t n)
+{
+	void *p = malloc(n);
+
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static size_t frame_size(unsigned int pixfmt, int w, int h)
+{
+	switch (pixfmt) {
+	case V4L2_PIX_FMT_RGB24:
+		return w * h * 3;
+	case V4L2_PIX_FMT_NV12:
+		return w * h * 3 / 2;
+	}
+	return w * h * 2;
+}
+
+static int stride_of(unsigned int pixfmt, int w)
+{
+	switch (pixfmt) {
+	case V4L2_PIX_FMT_RGB24:
+		return w * 3;
+	case V4L2_PIX_FMT_NV12:
+		return w;
+	}
+	return w * 2;
+}
+
+/* Output of the kernel under test into out, of the scalar one into ref */
+static void run_frame(const char *name, unsigned int pixfmt, int w, int h,
+		enum conv_order order, int offset)
+{
+	size_t n = (size_t) w * h * 4 + GUARD;
+
+	conv_select("scalar");
+	memset(ref, 0xa5, n);
+	conv_frame_to_32(pixfmt, src + offset, stride_of(pixfmt, w), ref,
+			w * 4, w, h, order);
+
+	conv_select(name);
+	memset(out, 0xa5, n);
+	conv_frame_to_32(pixfmt, src + offset, stride_of(pixfmt, w), out,
+			w * 4, w, h, order);
+
+	if (memcmp(ref, out, n) != 0) {
+		fprintf(stderr, "%s: %.4s %dx%d order %d offset %d differs\n",
+			name, (char *) &pixfmt, w, h, order, offset);
+		failures++;
+	}
+}
+
+static void check_kernel(const char *name)
+{
+	unsigned int f;
+	int w, o, fx, fy, before = failures;
+	uint64_t sad;
+	size_t n;
+
+	/* RGB24 through the kernel entry point, unaligned sources too */
+	for (o = 0; o < 2; o++) {
+		for (w = 0; w <= MAX_TAIL; w++) {
+			conv_select("scalar");
+			memset(ref, 0xa5, w * 4 + GUARD);
+			conv_rgb24_to_xrgb32(src + o, ref, w);
+			conv_select(name);
+			memset(out, 0xa5, w * 4 + GUARD);
+			conv_rgb24_to_xrgb32(src + o, out, w);
+			if (memcmp(ref, out, w * 4 + GUARD) != 0) {
+				fprintf(stderr, "%s: rgb24 %d pixels offset %d "
+					"differs\n", name, w, o);
+				failures++;
+			}
+		}
+	}
+	run_frame(name, V4L2_PIX_FMT_RGB24, FULL_W, FULL_H,
+			CONV_ORDER_BGRX, 0);
+
+	/* YUV rows come in pixel pairs */
+	for (f = 0; f < sizeof(yuv_formats) / sizeof(yuv_formats[0]); f++) {
+		for (w = 2; w <= MAX_TAIL; w += 2) {
+			run_frame(name, yuv_formats[f], w, 2,
+					CONV_ORDER_BGRX, 0);
+			run_frame(name, yuv_formats[f], w, 2,
+					CONV_ORDER_RGBX, 1);
+		}
+		run_frame(name, yuv_formats[f], FULL_W, FULL_H,
+				CONV_ORDER_BGRX, 0);
+		run_frame(name, yuv_formats[f], FULL_W, FULL_H,
+				CONV_ORDER_RGBX, 0);
+	}
+
+	for (n = 0; n <= MAX_TAIL * 4; n++) {
+		conv_select("scalar");
+		sad = conv_sad(src, src + n + 7, n);
+		conv_select(name);
+		if (conv_sad(src, src + n + 7, n) != sad) {
+			fprintf(stderr, "%s: sad of %zu bytes differs\n",
+				name, n);
+			failures++;
+		}
+	}
+	n = FULL_W * FULL_H * 2;
+	conv_select("scalar");
+	sad = conv_sad(src, src + n, n);
+	conv_select(name);
+	if (conv_sad(src, src + n, n) != sad) {
+		fprintf(stderr, "%s: sad of 1080p differs\n", name);
+		failures++;
+	}
+
+	/* the box filter reads 32 bit pixels through accumulate */
+	for (w = 1; w <= MAX_TAIL / 2; w++)
+		for (fx = 1; fx <= 3; fx++)
+			for (fy = 1; fy <= 3; fy++) {
+				if (w < fx)
+					continue;
+				n = (w / fx) * 4 * (4 / fy + 1) + GUARD;
+				conv_select("scalar");
+				memset(ref, 0xa5, n);
+				conv_downscale_32(src, w * 4, ref, (w / fx) * 4,
+						w, 4, fx, fy);
+				conv_select(name);
+				memset(out, 0xa5, n);
+				conv_downscale_32(src, w * 4, out, (w / fx) * 4,
+						w, 4, fx, fy);
+				if (memcmp(ref, out, n) != 0) {
+					fprintf(stderr, "%s: downscale %d/%dx%d "
+						"differs\n", name, w, fx, fy);
+					failures++;
+				}
+			}
+	n = (FULL_W / 4) * (FULL_H / 4) * 4 + GUARD;
+	conv_select("scalar");
+	memset(ref, 0xa5, n);
+	conv_downscale_32(src, FULL_W * 4, ref, FULL_W, FULL_W, FULL_H, 4, 4);
+	conv_select(name);
+	memset(out, 0xa5, n);
+	conv_downscale_32(src, FULL_W * 4, out, FULL_W, FULL_W, FULL_H, 4, 4);
+	if (memcmp(ref, out, n) != 0) {
+		fprintf(stderr, "%s: downscale 1080p differs\n", name);
+		failures++;
+	}
+
+	printf("%s: %s\n", name, failures > before ? "FAIL" : "ok");
+}
+
+/* Runs a 1080p conversion until BENCH_NS passed, returns ms per frame */
+static double time_frame(unsigned int pixfmt)
+{
+	uint64_t start = now_ns(), t;
+	long n = 0;
+
+	do {
+		conv_frame_to_32(pixfmt, src, stride_of(pixfmt, FULL_W), out,
+				FULL_W * 4, FULL_W, FULL_H, CONV_ORDER_BGRX);
+		n++;
+		t = now_ns() - start;
+	} while (t < BENCH_NS);
+	return t / 1e6 / n;
+}
+
+static double time_sad(void)
+{
+	uint64_t start = now_ns(), t;
+	volatile uint64_t sink;
+	long n = 0;
+
+	do {
+		sink = conv_sad(src, src + FULL_W * FULL_H * 2,
+				FULL_W * FULL_H * 2);
+		n++;
+		t = now_ns() - start;
+	} while (t < BENCH_NS);
+	(void) sink;
+	return t / 1e6 / n;
+}
+
+static double time_downscale(void)
+{
+	uint64_t start = now_ns(), t;
+	long n = 0;
+
+	do {
+		conv_downscale_32(src, FULL_W * 4, out, FULL_W, FULL_W, FULL_H,
+				4, 4);
+		n++;
+		t = now_ns() - start;
+	} while (t < BENCH_NS);
+	return t / 1e6 / n;
+}
+
+static void bench_kernel(const char *name)
+{
+	printf("%-8s %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n", name,
+		time_frame(V4L2_PIX_FMT_RGB24),
+		time_frame(V4L2_PIX_FMT_YUYV),
+		time_frame(V4L2_PIX_FMT_UYVY),
+		time_frame(V4L2_PIX_FMT_NV12),
+		time_sad(), time_downscale());
+}
+
+int main(int argc, char **argv)
+{
+	int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+	size_t src_size = frame_size(V4L2_PIX_FMT_RGB24, FULL_W, FULL_H) * 2;
+	size_t out_size = (size_t) FULL_W * FULL_H * 4 + GUARD;
+	unsigned int i;
+
+	/* twice the largest input, sad compares its two halves */
+	src = xmalloc(src_size + GUARD);
+	ref = xmalloc(out_size);
+	out = xmalloc(out_size);
+	fill_random(src, src_size + GUARD);
+
+	if (bench)
+		printf("1080p ms    rgb24     yuyv     uyvy     nv12      sad"
+			"  box 4x4\n");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (conv_select(kernels[i]) < 0) {
+			printf("%s: not available\n", kernels[i]);
+			continue;
+		}
+		if (bench) {
+			bench_kernel(kernels[i]);
+			continue;
+		}
+		check_kernel(kernels[i]);
+	}
+
+	free(src);
+	free(ref);
+	free(out);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONV_X86 1
+#include <immintrin.h>
+#endif
+
+#include "convert.h"
+
+typedef void (*ConvRgbFunction)(const unsigned char *src, unsigned char *dst,
+		int npixels);
+
+/* One row of YUV to 32 bit. uv holds U0 V0 U1 V1 ... for every pixel pair,
+with stride 2 for NV12 and 4 for packed YUYV/UYVY; y has stride 1 or 2 */
+typedef void (*ConvYuvRowFunction)(const unsigned char *y, int y_step,
+		const unsigned char *uv, int uv_step,
+		unsigned char *dst, int w, int swap);
+
+/* acc[i] += src[i] for n bytes, the vertical pass of the box filter */
+typedef void (*ConvAccumulateFunction)(const unsigned char *src,
+		uint16_t *acc, int n);
+
+/* Sum of absolute differences of n bytes */
+typedef uint64_t (*ConvSadFunction)(const unsigned char *a,
+		const unsigned char *b, int n);
+
+struct conv_impl {
+	const char      *name;
+	ConvRgbFunction rgb24_to_xrgb32;
+	ConvYuvRowFunction yuv_row;
+	ConvAccumulateFunction accumulate;
+	ConvSadFunction sad;
+};
+
+static const struct conv_impl *impl;
+
+/* Output pixel k takes source bytes 3k+2, 3k+1, 3k; 0x80 zeroes X */
+#define RGB_SHUFFLE_MASK \
+	2, 1, 0, 0x80, 5, 4, 3, 0x80, 8, 7, 6, 0x80, 11, 10, 9, 0x80
+
+static void rgb24_to_xrgb32_scalar(const unsigned char *src,
+		unsigned char *dst, int npixels)
+{
+	int i;
+
+	for (i = 0; i < npixels; ++i) {
+		*dst++ = src[2];
+		*dst++ = src[1];
+		*dst++ = src[0];
+		*dst++ = 0;
+
+		src += 3;
+	}
+}
+
+/* BT.601 limited range in 6 bit fixed point. The luma gain is 74.5,
+applied as (Y * 149) >> 1 on unsigned 16 bit values. The SIMD kernels
+compute the same sums with saturating 16 bit arithmetic, saturation only
+happens for results that clamp to 255 anyway, so all kernels are bit exact */
+#define YUV_CY2 149
+#define YUV_CRV 102
+#define YUV_CGU 25
+#define YUV_CGV 52
+#define YUV_CBU 129
+
+static inline unsigned char clamp8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void yuv_row_scalar(const unsigned char *y, int y_step,
+		const unsigned char *uv, int uv_step,
+		unsigned char *dst, int w, int swap)
+{
+	int i, c, d, e, r, g, b;
+
+	for (i = 0; i < w; ++i) {
+		c = y[i * y_step] < 16 ? 0 : y[i * y_step] - 16;
+		c = (c * YUV_CY2) >> 1;
+		d = uv[(i / 2) * uv_step] - 128;
+		e = uv[(i / 2) * uv_step + uv_step / 2] - 128;
+
+		r = clamp8((c + YUV_CRV * e + 32) >> 6);
+		g = clamp8((c - YUV_CGU * d - YUV_CGV * e + 32) >> 6);
+		b = clamp8((c + YUV_CBU * d + 32) >> 6);
+
+		*dst++ = swap ? r : b;
+		*dst++ = g;
+		*dst++ = swap ? b : r;
+		*dst++ = 0;
+	}
+}
+
+static void accumulate_scalar(const unsigned char *src, uint16_t *acc, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		acc[i] += src[i];
+}
+
+static uint64_t sad_scalar(const unsigned char *a, const unsigned char *b,
+		int n)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	return sum;
+}
+
+#ifdef CONV_X86
+__attribute__((target("ssse3")))
+static void rgb24_to_xrgb32_ssse3(const unsigned char *src,
+		unsigned char *dst, int npixels)
+{
+	const __m128i mask = _mm_setr_epi8(RGB_SHUFFLE_MASK);
+	__m128i a, b, c, d;
+	int i = 0;
+
+	for (; i + 18 <= npixels; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(src + 0));
+		b = _mm_loadu_si128((const __m128i *)(src + 12));
+		c = _mm_loadu_si128((const __m128i *)(src + 24));
+		d = _mm_loadu_si128((const __m128i *)(src + 36));
+		_mm_storeu_si128((__m128i *)(dst + 0), _mm_shuffle_epi8(a, mask));
+		_mm_storeu_si128((__m128i *)(dst + 16), _mm_shuffle_epi8(b, mask));
+		_mm_storeu_si128((__m128i *)(dst + 32), _mm_shuffle_epi8(c, mask));
+		_mm_storeu_si128((__m128i *)(dst + 48), _mm_shuffle_epi8(d, mask));
+		src += 48;
+		dst += 64;
+	}
+	rgb24_to_xrgb32_scalar(src, dst, npixels - i);
+}
+
+/* 8 pixels: y holds Y0..Y7, uv holds U0 V0 .. U3 V3, all as int16 */
+__attribute__((target("sse2")))
+static inline void yuv_to_32_sse2(__m128i y, __m128i uv,
+		unsigned char *dst, int swap)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(32);
+	__m128i u, v, r, g, b, bg, rx;
+
+	y = _mm_max_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), zero);
+	uv = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+	u = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv,
+			_MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+	v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv,
+			_MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+
+	y = _mm_srli_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(YUV_CY2)), 1);
+	r = _mm_adds_epi16(y, _mm_mullo_epi16(v, _mm_set1_epi16(YUV_CRV)));
+	g = _mm_sub_epi16(y, _mm_mullo_epi16(u, _mm_set1_epi16(YUV_CGU)));
+	g = _mm_sub_epi16(g, _mm_mullo_epi16(v, _mm_set1_epi16(YUV_CGV)));
+	b = _mm_adds_epi16(y, _mm_mullo_epi16(u, _mm_set1_epi16(YUV_CBU)));
+
+	r = _mm_srai_epi16(_mm_adds_epi16(r, round), 6);
+	g = _mm_srai_epi16(_mm_adds_epi16(g, round), 6);
+	b = _mm_srai_epi16(_mm_adds_epi16(b, round), 6);
+
+	r = _mm_packus_epi16(r, r);
+	g = _mm_packus_epi16(g, g);
+	b = _mm_packus_epi16(b, b);
+
+	bg = _mm_unpacklo_epi8(swap ? r : b, g);
+	rx = _mm_unpacklo_epi8(swap ? b : r, zero);
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, rx));
+	_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg, rx));
+}
+
+__attribute__((target("sse2")))
+static void yuv_row_sse2(const unsigned char *y, int y_step,
+		const unsigned char *uv, int uv_step,
+		unsigned char *dst, int w, int swap)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	__m128i in;
+	int i = 0;
+
+	if (y_step == 2) {
+		/* packed: y and uv point into the same YUYV or UYVY row,
+		whichever comes first is the start of the pixel pair */
+		for (; i + 8 <= w; i += 8) {
+			in = _mm_loadu_si128((const __m128i *)
+					(y < uv ? y + i * 2 : uv + i * 2));
+			if (y < uv)
+				yuv_to_32_sse2(_mm_and_si128(in, lo),
+					_mm_srli_epi16(in, 8), dst, swap);
+			else
+				yuv_to_32_sse2(_mm_srli_epi16(in, 8),
+					_mm_and_si128(in, lo), dst, swap);
+			dst += 32;
+		}
+	} else {
+		const __m128i zero = _mm_setzero_si128();
+
+		for (; i + 8 <= w; i += 8) {
+			yuv_to_32_sse2(
+				_mm_unpacklo_epi8(_mm_loadl_epi64(
+					(const __m128i *)(y + i)), zero),
+				_mm_unpacklo_epi8(_mm_loadl_epi64(
+					(const __m128i *)(uv + i)), zero),
+				dst, swap);
+			dst += 32;
+		}
+	}
+	yuv_row_scalar(y + i * y_step, y_step, uv + (i / 2) * uv_step,
+			uv_step, dst, w - i, swap);
+}
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(const unsigned char *src, uint16_t *acc, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i in, lo, hi;
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		in = _mm_loadu_si128((const __m128i *)(src + i));
+		lo = _mm_loadu_si128((const __m128i *)(acc + i));
+		hi = _mm_loadu_si128((const __m128i *)(acc + i + 8));
+		lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(in, zero));
+		hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(in, zero));
+		_mm_storeu_si128((__m128i *)(acc + i), lo);
+		_mm_storeu_si128((__m128i *)(acc + i + 8), hi);
+	}
+	accumulate_scalar(src + i, acc + i, n - i);
+}
+
+/* psadbw leaves two 64 bit partial sums per 16 bytes */
+__attribute__((target("sse2")))
+static uint64_t sad_sse2(const unsigned char *a, const unsigned char *b,
+		int n)
+{
+	__m128i sum = _mm_setzero_si128();
+	uint64_t total;
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(
+				_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i))));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	_mm_storel_epi64((__m128i *)&total, sum);
+	return total + sad_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sad_avx2(const unsigned char *a, const unsigned char *b,
+		int n)
+{
+	__m256i sum = _mm256_setzero_si256();
+	__m128i s;
+	uint64_t total;
+	int i = 0;
+
+	for (; i + 32 <= n; i += 32)
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(
+				_mm256_loadu_si256((const __m256i *)(a + i)),
+				_mm256_loadu_si256((const __m256i *)(b + i))));
+	s = _mm_add_epi64(_mm256_castsi256_si128(sum),
+			_mm256_extracti128_si256(sum, 1));
+	s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+	_mm_storel_epi64((__m128i *)&total, s);
+	return total + sad_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(const unsigned char *src, uint16_t *acc, int n)
+{
+	__m256i a, b;
+	int i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		a = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+				(const __m128i *)(src + i)));
+		b = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+				(const __m128i *)(src + i + 16)));
+		a = _mm256_add_epi16(a, _mm256_loadu_si256(
+				(const __m256i *)(acc + i)));
+		b = _mm256_add_epi16(b, _mm256_loadu_si256(
+				(const __m256i *)(acc + i + 16)));
+		_mm256_storeu_si256((__m256i *)(acc + i), a);
+		_mm256_storeu_si256((__m256i *)(acc + i + 16), b);
+	}
+	accumulate_sse2(src + i, acc + i, n - i);
+}
+
+#endif
+
+static const struct conv_impl impls[] = {
+#ifdef CONV_X86
+	/* 256 bit pshufb only shuffles within lanes, the 24 to 32 bit
+	expansion measured no faster than ssse3's and keeps that one */
+	{ "avx2", rgb24_to_xrgb32_ssse3, yuv_row_sse2, accumulate_avx2,
+		sad_avx2 },
+	{ "ssse3", rgb24_to_xrgb32_ssse3, yuv_row_sse2, accumulate_sse2,
+		sad_sse2 },
+#endif
+	{ "scalar", rgb24_to_xrgb32_scalar, yuv_row_scalar, accumulate_scalar,
+		sad_scalar },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static int impl_runnable(const struct conv_impl *i)
+{
+#ifdef CONV_X86
+	__builtin_cpu_init();
+	if (strcmp(i->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(i->name, "ssse3") == 0)
+		return __builtin_cpu_supports("ssse3");
+#endif
+	return 1;
+}
+
+static void conv_init(void)
+{
+	const struct conv_impl *i;
+	const char *force;
+
+	force = getenv("SVV_CONV");
+
+	for (i = impls; i->name; ++i) {
+		if (!impl_runnable(i))
+			continue;
+		if (force) {
+			if (strcmp(force, i->name) == 0)
+				break;
+			continue;
+		}
+		break;
+	}
+
+	if (!i->name) {
+		fprintf(stderr, "SVV_CONV=%s not available, using scalar\n",
+			force);
+		i = &impls[sizeof(impls) / sizeof(impls[0]) - 2];
+	}
+	impl = i;
+}
+
+void conv_rgb24_to_xrgb32(const unsigned char *src, unsigned char *dst,
+		int npixels)
+{
+	if (!impl)
+		conv_init();
+	impl->rgb24_to_xrgb32(src, dst, npixels);
+}
+
+const char *conv_impl_name(void)
+{
+	if (!impl)
+		conv_init();
+	return impl->name;
+}
+
+int conv_select(const char *name)
+{
+	const struct conv_impl *i;
+
+	for (i = impls; i->name; ++i)
+		if (strcmp(i->name, name) == 0 && impl_runnable(i)) {
+			impl = i;
+			return 0;
+		}
+	return -1;
+}
+
+int conv_supported(unsigned int pixfmt)
+{
+	switch (pixfmt) {
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_XBGR32:
+		return 1;
+	}
+	return 0;
+}
+
+/* In quarter bytes per pixel. The YUV formats are smaller but need the
+multiplies, the shuffle of RGB24 is almost free */
+unsigned int conv_cost(unsigned int pixfmt, int convert)
+{
+	switch (pixfmt) {
+	case V4L2_PIX_FMT_RGB24:
+		return 12 + (convert ? 2 : 0);
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+		return 8 + (convert ? 6 : 0);
+	case V4L2_PIX_FMT_NV12:
+		return 6 + (convert ? 6 : 0);
+	case V4L2_PIX_FMT_XBGR32:
+		return 16;
+	}
+	return UINT_MAX;
+}
+
+size_t conv_frame_size(unsigned int pixfmt, int src_stride, int h)
+{
+	/* a chroma row per two luma rows, the last one shared if h is odd */
+	if (pixfmt == V4L2_PIX_FMT_NV12)
+		return (size_t) src_stride * (h + (h + 1) / 2);
+	return (size_t) src_stride * h;
+}
+
+void conv_frame_to_32(unsigned int pixfmt,
+		const unsigned char *src, int src_stride,
+		unsigned char *dst, int dst_stride,
+		int w, int h, enum conv_order order)
+{
+	const unsigned char *row, *uv;
+	int swap = (order == CONV_ORDER_RGBX);
+	int i, j;
+
+	if (!impl)
+		conv_init();
+
+	for (j = 0; j < h; ++j) {
+		row = src + j * src_stride;
+
+		switch (pixfmt) {
+		case V4L2_PIX_FMT_RGB24:
+			if (!swap) {
+				impl->rgb24_to_xrgb32(row, dst, w);
+				break;
+			}
+			for (i = 0; i < w; ++i) {
+				dst[i * 4 + 0] = row[i * 3 + 0];
+				dst[i * 4 + 1] = row[i * 3 + 1];
+				dst[i * 4 + 2] = row[i * 3 + 2];
+				dst[i * 4 + 3] = 0;
+			}
+			break;
+		case V4L2_PIX_FMT_YUYV:
+			impl->yuv_row(row, 2, row + 1, 4, dst, w, swap);
+			break;
+		case V4L2_PIX_FMT_UYVY:
+			impl->yuv_row(row + 1, 2, row, 4, dst, w, swap);
+			break;
+		case V4L2_PIX_FMT_NV12:
+			uv = src + h * src_stride + (j / 2) * src_stride;
+			impl->yuv_row(row, 1, uv, 2, dst, w, swap);
+			break;
+		case V4L2_PIX_FMT_XBGR32:
+			if (!swap) {
+				memcpy(dst, row, w * 4);
+				break;
+			}
+			for (i = 0; i < w; ++i) {
+				dst[i * 4 + 0] = row[i * 4 + 2];
+				dst[i * 4 + 1] = row[i * 4 + 1];
+				dst[i * 4 + 2] = row[i * 4 + 0];
+				dst[i * 4 + 3] = 0;
+			}
+			break;
+		}
+		dst += dst_stride;
+	}
+}
+
+uint64_t conv_sad(const unsigned char *a, const unsigned char *b, int n)
+{
+	if (!impl)
+		conv_init();
+	return impl->sad(a, b, n);
+}
+
+void conv_downscale_32(const unsigned char *src, int src_stride,
+		unsigned char *dst, int dst_stride,
+		int w, int h, int fx, int fy)
+{
+	int dw = w / fx, dh = h / fy, n = fx * fy;
+	uint16_t acc[dw * fx * 4];
+	unsigned int sum[4];
+	int i, j, k, c;
+
+	if (!impl)
+		conv_init();
+
+	for (j = 0; j < dh; ++j) {
+		/* vertical: add up fy rows, 16 bit lanes hold 257 rows */
+		memset(acc, 0, sizeof(acc));
+		for (k = 0; k < fy; ++k)
+			impl->accumulate(src + (j * fy + k) * src_stride,
+					acc, dw * fx * 4);
+
+		/* horizontal: fx pixels per output pixel, a row of dw */
+		for (i = 0; i < dw; ++i) {
+			sum[0] = sum[1] = sum[2] = sum[3] = 0;
+			for (k = 0; k < fx; ++k)
+				for (c = 0; c < 4; ++c)
+					sum[c] += acc[(i * fx + k) * 4 + c];
+			for (c = 0; c < 4; ++c)
+				dst[i * 4 + c] = (sum[c] + n / 2) / n;
+		}
+		dst += dst_stride;
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pixel conversion kernels. The fastest implementation for the running CPU
+ * is picked on first use, set SVV_CONV=scalar|ssse3|avx2 to force one.
+ */
+
+/* Byte order of 32 bit output pixels */
+enum conv_order {
+	CONV_ORDER_BGRX,	/* XRGB8888 little endian: wl_shm, cairo, caca */
+	CONV_ORDER_RGBX,	/* gdk_draw_rgb_32_image() */
+};
+
+/* RGB24 (R,G,B bytes) to little endian XRGB8888 (B,G,R,X bytes) */
+void conv_rgb24_to_xrgb32(const unsigned char *src, unsigned char *dst,
+		int npixels);
+
+/* Returns 1 if conv_frame_to_32() handles the V4L2 pixel format */
+int conv_supported(unsigned int pixfmt);
+
+/* Relative cost per pixel of bringing a frame in pixfmt to the display:
+the bytes it takes, plus the arithmetic of conv_frame_to_32() when convert
+is set. UINT_MAX if the format is not supported */
+unsigned int conv_cost(unsigned int pixfmt, int convert);
+
+/* Converts a whole RGB24, YUYV, UYVY or NV12 frame (BT.601 limited range),
+or an XBGR32 one (B,G,R,X bytes, as composed by svv itself), to 32 bit
+pixels in a single pass. src_stride is the V4L2 bytesperline */
+void conv_frame_to_32(unsigned int pixfmt,
+		const unsigned char *src, int src_stride,
+		unsigned char *dst, int dst_stride,
+		int w, int h, enum conv_order order);
+
+/* Bytes of src that conv_frame_to_32() reads, with the chroma plane that
+follows the luma one in NV12. Shorter frames must not be converted */
+size_t conv_frame_size(unsigned int pixfmt, int src_stride, int h);
+
+/* Box filter for 32 bit pixels: each fx by fy block of src is averaged
+into one pixel of dst, which is w / fx by h / fy. fy is at most 257 */
+void conv_downscale_32(const unsigned char *src, int src_stride,
+		unsigned char *dst, int dst_stride,
+		int w, int h, int fx, int fy);
+
+/* Sum of absolute differences of n bytes of a and b */
+uint64_t conv_sad(const unsigned char *a, const unsigned char *b, int n);
+
+/* Name of the kernel selected at runtime */
+const char *conv_impl_name(void);
+
+/* Uses the named kernel from now on, for convert-test. Returns -1 if it
+is not compiled in or the CPU lacks it */
+int conv_select(const char *name);
+
+#endif // CONVERT_H
@@ -0,0 +1,13 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+/* Bookkeeping that travels with every frame, times are CLOCK_MONOTONIC ns */
+struct frame_info {
+	uint32_t        sequence;
+	uint64_t        driver_ns;	/* buffer timestamp set by the driver */
+	uint64_t        dequeue_ns;	/* when svv got the buffer */
+};
+
+#endif // FRAME_H
@@ -0,0 +1,71 @@
+#include <string.h>
+
+#include "histogram.h"
+
+#define SUB_COUNT (1 << HIST_SUB_BITS)
+
+static unsigned int bucket_of(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < SUB_COUNT)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+		+ ((v >> (e - HIST_SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* highest value that lands in bucket i */
+static uint64_t bucket_top(unsigned int i)
+{
+	unsigned int e;
+
+	if (i < SUB_COUNT)
+		return i;
+
+	e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	return (((uint64_t) (SUB_COUNT + (i & (SUB_COUNT - 1)) + 1))
+		<< (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct histogram *h, uint64_t v)
+{
+	h->counts[bucket_of(v)]++;
+	if (h->total == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->total++;
+	h->sum += v;
+}
+
+uint64_t hist_quantile(const struct histogram *h, double q)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (h->total == 0)
+		return 0;
+
+	rank = q * h->total;
+	if (rank >= h->total)
+		rank = h->total - 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen > rank)
+			return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+	}
+	return h->max;
+}
+
+double hist_mean(const struct histogram *h)
+{
+	return h->total ? h->sum / h->total : 0;
+}
@@ -0,0 +1,31 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram: every power of two
+ * is split into 2^HIST_SUB_BITS linear buckets, so any recorded value is
+ * off by at most ~3%, from nanoseconds to hours, in a fixed 16KiB.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram {
+	uint64_t        counts[HIST_BUCKETS];
+	uint64_t        total;
+	uint64_t        min;
+	uint64_t        max;
+	double          sum;
+};
+
+void hist_reset(struct histogram *h);
+
+void hist_record(struct histogram *h, uint64_t v);
+
+/* Value at quantile q (0..1), 0 if nothing was recorded */
+uint64_t hist_quantile(const struct histogram *h, double q);
+
+double hist_mean(const struct histogram *h);
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "lowlat.h"
+
+void lowlat_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		fprintf(stderr, "mlockall: %s, page faults may stall capture\n",
+			strerror(errno));
+}
+
+void lowlat_setup_thread(const char *name, int cpu, int priority)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int r;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (r != 0)
+			fprintf(stderr, "%s: cannot pin to cpu %d: %s\n",
+				name, cpu, strerror(r));
+	}
+
+	if (priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (r != 0)
+			fprintf(stderr, "%s: cannot use SCHED_FIFO %d: %s\n",
+				name, priority, strerror(r));
+	}
+}
+
+void lowlat_account(struct lowlat_jitter *j, const struct frame_info *info)
+{
+	uint64_t driver_step, dequeue_step;
+
+	hist_record(&j->latency, info->dequeue_ns > info->driver_ns ?
+			info->dequeue_ns - info->driver_ns : 0);
+
+	if (j->valid) {
+		driver_step = info->driver_ns - j->last_driver_ns;
+		dequeue_step = info->dequeue_ns - j->last_dequeue_ns;
+		hist_record(&j->jitter, dequeue_step > driver_step ?
+				dequeue_step - driver_step :
+				driver_step - dequeue_step);
+	}
+	j->last_driver_ns = info->driver_ns;
+	j->last_dequeue_ns = info->dequeue_ns;
+	j->valid = 1;
+}
+
+static void report_line(FILE *fp, const char *what, const struct histogram *h)
+{
+	fprintf(fp, "  %-8s %8.3f %8.3f %8.3f %8.3f\n", what,
+		hist_quantile(h, 0.5) / 1e6,
+		hist_quantile(h, 0.99) / 1e6,
+		hist_quantile(h, 0.999) / 1e6,
+		h->max / 1e6);
+}
+
+void lowlat_report(FILE *fp, const char *name, const struct lowlat_jitter *j)
+{
+	fprintf(fp, "%s capture (ms)      p50      p99     p999      max\n",
+		name);
+	report_line(fp, "dequeue", &j->latency);
+	report_line(fp, "jitter", &j->jitter);
+}
@@ -0,0 +1,44 @@
+#ifndef LOWLAT_H
+#define LOWLAT_H
+
+#include <stdio.h>
+
+#include "frame.h"
+#include "histogram.h"
+
+/*
+ * Low latency capture: real time scheduling, CPU pinning and locked
+ * memory for the capture threads, and the dequeue latency and jitter they
+ * achieve, measured on the capture thread itself.
+ */
+
+struct lowlat_jitter {
+	struct histogram latency;	/* driver timestamp to dequeue */
+	struct histogram jitter;	/* dequeue spacing vs. frame spacing */
+	int             valid;
+	uint64_t        last_driver_ns;
+	uint64_t        last_dequeue_ns;
+};
+
+/* Locks current and future pages, page faults are the worst stalls */
+void lowlat_lock_memory(void);
+
+/* Applies to the calling thread. cpu < 0 leaves the affinity alone,
+priority 0 keeps the normal scheduler. Failures only warn */
+void lowlat_setup_thread(const char *name, int cpu, int priority);
+
+/* Busy-poll backoff, keeps the spinning core polite to its sibling */
+static inline void lowlat_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+void lowlat_account(struct lowlat_jitter *j, const struct frame_info *info);
+
+void lowlat_report(FILE *fp, const char *name, const struct lowlat_jitter *j);
+
+#endif // LOWLAT_H
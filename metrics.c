@@ -0,0 +1,291 @@
+#define _GNU_SOURCE	/* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "metrics.h"
+
+#define MAX_CLIENTS 16
+#define CLIENT_TIMEOUT_MS 5000	/* to send the request and take the answer */
+
+/* A connection, read and then answered from its own watch so that a slow
+client never holds up the main loop */
+struct client {
+	int             fd;
+	guint           watch_id;
+	guint           timeout_id;
+	char            request[1024];
+	size_t          request_len;
+	char            *response;
+	size_t          response_len;
+	size_t          written;
+	struct client   *next;
+};
+
+static int listen_fd = -1;
+static guint listen_id;
+static char *socket_path;
+static MetricsFunction metrics_func;
+static struct client *clients;
+static unsigned int n_clients;
+
+static void client_free(struct client *c)
+{
+	struct client **pp;
+
+	for (pp = &clients; *pp; pp = &(*pp)->next)
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	n_clients--;
+
+	if (c->watch_id)
+		g_source_remove(c->watch_id);
+	if (c->timeout_id)
+		g_source_remove(c->timeout_id);
+	close(c->fd);
+	free(c->response);
+	free(c);
+}
+
+/* A client that keeps its connection open without finishing would hold a
+slot for good, MAX_CLIENTS of them would lock the scraper out */
+static gboolean client_expire(gpointer data)
+{
+	struct client *c = data;
+
+	/* returning FALSE removes the timeout */
+	c->timeout_id = 0;
+	client_free(c);
+	return FALSE;
+}
+
+static guint client_watch(struct client *c, GIOCondition condition,
+		GIOFunc func)
+{
+	GIOChannel *ioc;
+	guint id;
+
+	ioc = g_io_channel_unix_new(c->fd);
+	id = g_io_add_watch(ioc, condition | G_IO_HUP | G_IO_ERR, func, c);
+	g_io_channel_unref(ioc);
+	return id;
+}
+
+static gboolean client_write(GIOChannel *source, GIOCondition condition,
+		gpointer data)
+{
+	struct client *c = data;
+	ssize_t n;
+
+	while (c->written < c->response_len) {
+		/* a client gone meanwhile must not SIGPIPE svv */
+		n = send(c->fd, c->response + c->written,
+			c->response_len - c->written, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return TRUE;
+			break;
+		}
+		c->written += n;
+	}
+
+	/* returning FALSE removes the watch */
+	c->watch_id = 0;
+	client_free(c);
+	return FALSE;
+}
+
+/* The whole response is built at once, the figures are of one moment */
+static int client_respond(struct client *c)
+{
+	char *body = NULL, header[128];
+	size_t body_len = 0;
+	FILE *fp;
+	int len;
+
+	fp = open_memstream(&body, &body_len);
+	if (!fp)
+		return -1;
+	metrics_func(fp);
+	if (fclose(fp) != 0) {
+		free(body);
+		return -1;
+	}
+
+	len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n", body_len);
+	c->response = malloc(len + body_len);
+	if (!c->response) {
+		free(body);
+		return -1;
+	}
+	memcpy(c->response, header, len);
+	memcpy(c->response + len, body, body_len);
+	c->response_len = len + body_len;
+	free(body);
+
+	c->watch_id = client_watch(c, G_IO_OUT, client_write);
+	return 0;
+}
+
+/* The request is not parsed, whatever was asked the answer is the same.
+It is read up to the blank line that ends it, or until the client stops
+sending or fills the buffer */
+static gboolean client_read(GIOChannel *source, GIOCondition condition,
+		gpointer data)
+{
+	struct client *c = data;
+	ssize_t n;
+
+	for (;;) {
+		n = read(c->fd, c->request + c->request_len,
+			sizeof(c->request) - 1 - c->request_len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return TRUE;
+			c->watch_id = 0;
+			client_free(c);
+			return FALSE;
+		}
+		c->request_len += n;
+		c->request[c->request_len] = '\0';
+		if (n == 0 || c->request_len == sizeof(c->request) - 1
+				|| strstr(c->request, "\r\n\r\n")
+				|| strstr(c->request, "\n\n"))
+			break;
+	}
+
+	/* nothing asked, nobody to answer */
+	c->watch_id = 0;
+	if (c->request_len == 0 || client_respond(c) < 0)
+		client_free(c);
+	return FALSE;
+}
+
+static gboolean metrics_accept(GIOChannel *source, GIOCondition condition,
+		gpointer data)
+{
+	struct client *c;
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return TRUE;
+
+	c = n_clients < MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+	if (!c) {
+		close(fd);
+		return TRUE;
+	}
+	c->fd = fd;
+	c->next = clients;
+	clients = c;
+	n_clients++;
+
+	c->watch_id = client_watch(c, G_IO_IN, client_read);
+	c->timeout_id = g_timeout_add(CLIENT_TIMEOUT_MS, client_expire, c);
+	return TRUE;
+}
+
+/* Only a socket nobody listens on refuses the connection. One that takes
+it, or whose backlog is full, is another svv still serving metrics */
+static int stale_socket(const struct sockaddr_un *addr)
+{
+	int fd, ret = -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0
+			|| errno == EAGAIN)
+		fprintf(stderr, "%s: in use by another process\n",
+			addr->sun_path);
+	else if (errno == ECONNREFUSED)
+		ret = 0;
+	else
+		fprintf(stderr, "%s: %s\n", addr->sun_path, strerror(errno));
+	close(fd);
+	return ret;
+}
+
+int metrics_listen(const char *path, MetricsFunction func)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	GIOChannel *ioc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* a socket left behind by an svv that did not exit cleanly is
+	replaced, anything else at path is not ours to remove */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s: exists and is not a socket\n",
+				path);
+			return -1;
+		}
+		if (stale_socket(&addr) < 0)
+			return -1;
+		unlink(path);
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(listen_fd, 8) < 0) {
+		perror(path);
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	socket_path = strdup(path);
+	metrics_func = func;
+
+	ioc = g_io_channel_unix_new(listen_fd);
+	listen_id = g_io_add_watch(ioc, G_IO_IN, metrics_accept, NULL);
+	g_io_channel_unref(ioc);
+	return 0;
+}
+
+void metrics_close(void)
+{
+	if (listen_fd < 0)
+		return;
+
+	while (clients)
+		client_free(clients);
+	g_source_remove(listen_id);
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(socket_path);
+	free(socket_path);
+	socket_path = NULL;
+}
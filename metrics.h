@@ -0,0 +1,22 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+/*
+ * Prometheus endpoint on a Unix domain socket, served from the GLib main
+ * loop. Every connection gets one HTTP response with the current metrics
+ * and is closed, so `curl --unix-socket` and scrapers both work.
+ */
+
+/* Writes the metrics in Prometheus text format */
+typedef void (*MetricsFunction)(FILE *fp);
+
+/* Replaces a stale socket at path, but not one that is still served or
+anything else. Returns -1 on error */
+int metrics_listen(const char *path, MetricsFunction func);
+
+/* Closes and unlinks the socket */
+void metrics_close(void);
+
+#endif // METRICS_H
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "motion.h"
+#include "convert.h"
+
+/* still frames before a motion end event */
+#define MOTION_HOLD_FRAMES 30
+
+struct motion {
+	const char      *name;
+	unsigned char   *ref;		/* last frame let through */
+	int             valid;
+	unsigned int    stride;
+	unsigned int    rows;		/* of the compared plane */
+	unsigned int    threshold;
+
+	int             moving;
+	unsigned int    still;		/* frames since the last change */
+	uint32_t        start_sequence;
+	unsigned long   passed;
+	unsigned long   skipped;
+	unsigned long   events;
+};
+
+struct motion *motion_new(const char *name, const struct v4l2_pix_format *pix,
+		unsigned int threshold)
+{
+	struct motion *m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->name = name;
+	m->stride = pix->bytesperline;
+	m->rows = pix->height;
+	m->threshold = threshold;
+	m->ref = malloc(m->stride * m->rows);
+	if (!m->ref) {
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+/* Tiles whose mean difference per byte exceeds the threshold */
+static unsigned int changed_tiles(struct motion *m, const unsigned char *p)
+{
+	unsigned int tx, ty, y, x0, x1, y0, y1, changed = 0;
+	uint64_t sad;
+
+	for (ty = 0; ty < MOTION_GRID; ty++) {
+		y0 = ty * m->rows / MOTION_GRID;
+		y1 = (ty + 1) * m->rows / MOTION_GRID;
+		for (tx = 0; tx < MOTION_GRID; tx++) {
+			x0 = tx * m->stride / MOTION_GRID;
+			x1 = (tx + 1) * m->stride / MOTION_GRID;
+			sad = 0;
+			for (y = y0; y < y1; y++)
+				sad += conv_sad(p + y * m->stride + x0,
+						m->ref + y * m->stride + x0,
+						x1 - x0);
+			if (sad > (uint64_t) m->threshold
+					* (x1 - x0) * (y1 - y0))
+				changed++;
+		}
+	}
+	return changed;
+}
+
+int motion_check(struct motion *m, const unsigned char *p, size_t len,
+		const struct frame_info *info)
+{
+	size_t size = (size_t) m->stride * m->rows;
+	unsigned int changed;
+
+	/* short frames cannot be compared, let them through */
+	if (len < size) {
+		m->passed++;
+		return 1;
+	}
+
+	changed = m->valid ? changed_tiles(m, p) : MOTION_GRID * MOTION_GRID;
+	if (!changed) {
+		if (m->moving && ++m->still >= MOTION_HOLD_FRAMES) {
+			printf("%s: motion end, sequence %u, %u frames\n",
+				m->name, info->sequence,
+				info->sequence - m->start_sequence);
+			m->moving = 0;
+		}
+		m->skipped++;
+		return 0;
+	}
+
+	if (!m->moving && m->valid) {
+		printf("%s: motion start, sequence %u, %u of %u tiles\n",
+			m->name, info->sequence, changed,
+			MOTION_GRID * MOTION_GRID);
+		m->moving = 1;
+		m->start_sequence = info->sequence;
+		m->events++;
+	}
+	m->still = 0;
+	m->valid = 1;
+	memcpy(m->ref, p, size);
+	m->passed++;
+	return 1;
+}
+
+void motion_free(struct motion *m)
+{
+	if (!m)
+		return;
+	printf("%s: %lu frames changed, %lu unchanged skipped, "
+		"%lu motion events\n", m->name, m->passed, m->skipped,
+		m->events);
+	free(m->ref);
+	free(m);
+}
@@ -0,0 +1,34 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stddef.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+/*
+ * Change detection. Each frame is compared with the last one let through,
+ * on a grid of tiles, by the sum of absolute differences of the raw bytes
+ * (the luma plane for NV12). Frames where no tile changed by more than the
+ * threshold are not worth displaying or recording. Motion start and end
+ * are printed as events.
+ */
+
+#define MOTION_GRID 8		/* tiles per axis */
+
+struct motion;
+
+/* threshold is the mean difference per byte a tile needs to count as
+changed */
+struct motion *motion_new(const char *name, const struct v4l2_pix_format *pix,
+		unsigned int threshold);
+
+/* Returns 1 if the frame changed and should be passed on, 0 if not */
+int motion_check(struct motion *m, const unsigned char *p, size_t len,
+		const struct frame_info *info);
+
+/* Prints how many frames were skipped */
+void motion_free(struct motion *m);
+
+#endif // MOTION_H
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include <glib.h>
+
+#include "player.h"
+#include "recfile.h"
+#include "stats.h"
+
+#define PLAYER_PREFETCH 8		/* frames advised ahead */
+#define PLAYER_DEFAULT_INTERVAL 33333333ULL	/* ns, without an index */
+
+struct player {
+	struct recfile  *rf;
+	double          speed;
+	unsigned long   next;		/* frame to show next */
+	unsigned long   first;
+	unsigned long   prefetched;	/* frames below this were advised */
+	int             timer_fd;
+	GIOChannel      *channel;
+	guint           source_id;
+	uint64_t        start_ns;	/* when the first frame was shown */
+	unsigned long   played;
+	unsigned long   late;
+	struct stats_sequence seq;
+	PlayerFrameFunction frame;
+	PlayerDoneFunction done;
+};
+
+/* Recorded time of frame i relative to the first one played */
+static uint64_t media_ns(const struct player *pl, unsigned long i)
+{
+	const struct recfile_index *index = pl->rf->index;
+
+	if (!index)
+		return (i - pl->first) * PLAYER_DEFAULT_INTERVAL;
+	if (index[i].timestamp_ns < index[pl->first].timestamp_ns)
+		return 0;
+	return index[i].timestamp_ns - index[pl->first].timestamp_ns;
+}
+
+static uint64_t due_ns(const struct player *pl, unsigned long i)
+{
+	return pl->start_ns + (uint64_t)(media_ns(pl, i) / pl->speed);
+}
+
+static void prefetch(struct player *pl)
+{
+	const struct recfile_header *h = pl->rf->hdr;
+	unsigned long end = pl->next + PLAYER_PREFETCH;
+	size_t off, len;
+
+	if (end > pl->rf->n_frames)
+		end = pl->rf->n_frames;
+	if (pl->prefetched < pl->next)
+		pl->prefetched = pl->next;
+	if (pl->prefetched >= end)
+		return;
+
+	off = h->header_size + pl->prefetched * h->slot_size;
+	len = (end - pl->prefetched) * h->slot_size;
+	madvise((void *)(pl->rf->map + off), len, MADV_WILLNEED);
+	pl->prefetched = end;
+}
+
+static void show(struct player *pl)
+{
+	struct frame_info info;
+	const unsigned char *p;
+	size_t len;
+
+	p = recfile_frame(pl->rf, pl->next, &len, &info);
+	/* the recorded timestamps are from another boot, latency is only
+	meaningful from here on */
+	info.dequeue_ns = stats_now();
+	info.driver_ns = info.dequeue_ns;
+	/* gaps in the recorded sequence show up as driver drops */
+	stats_account_sequence(&pl->seq, info.sequence);
+
+	pl->next++;
+	pl->played++;
+	prefetch(pl);
+	pl->frame((unsigned char *) p, len, &info);
+}
+
+static void finish(struct player *pl)
+{
+	pl->source_id = 0;
+	pl->done();
+}
+
+static gboolean play_idle(gpointer data)
+{
+	struct player *pl = data;
+
+	if (pl->next >= pl->rf->n_frames) {
+		finish(pl);
+		return FALSE;
+	}
+	show(pl);
+	return TRUE;
+}
+
+static void arm(struct player *pl)
+{
+	struct itimerspec its;
+	uint64_t due = due_ns(pl, pl->next);
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due / 1000000000ULL;
+	its.it_value.tv_nsec = due % 1000000000ULL;
+	if (timerfd_settime(pl->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timerfd_settime");
+}
+
+static gboolean play_timer(GIOChannel *source, GIOCondition condition,
+		gpointer data)
+{
+	struct player *pl = data;
+	struct frame_info info;
+	uint64_t expirations, now;
+	size_t len;
+
+	if (read(pl->timer_fd, &expirations, sizeof(expirations)) < 0
+			&& errno == EAGAIN)
+		return TRUE;
+
+	/* keep to the clock, frames the display was too slow for are
+	skipped rather than slowing the whole playback down */
+	now = stats_now();
+	while (pl->next + 1 < pl->rf->n_frames
+			&& due_ns(pl, pl->next + 1) <= now) {
+		recfile_frame(pl->rf, pl->next, &len, &info);
+		stats_mark_late(&pl->seq, info.sequence);
+		pl->next++;
+		pl->late++;
+	}
+
+	show(pl);
+
+	if (pl->next >= pl->rf->n_frames) {
+		finish(pl);
+		return FALSE;
+	}
+	arm(pl);
+	return TRUE;
+}
+
+struct player *player_open(const char *path, double speed,
+		unsigned long start)
+{
+	struct player *pl;
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl)
+		return NULL;
+	pl->timer_fd = -1;
+
+	pl->rf = recfile_open(path);
+	if (!pl->rf) {
+		fprintf(stderr, "Cannot play '%s': %d, %s\n",
+			path, errno, errno == EINVAL ? "not a recording"
+			: strerror(errno));
+		free(pl);
+		return NULL;
+	}
+	if (start >= pl->rf->n_frames) {
+		fprintf(stderr, "'%s' has %lu frames\n", path,
+			pl->rf->n_frames);
+		recfile_close(pl->rf);
+		free(pl);
+		return NULL;
+	}
+
+	pl->speed = speed;
+	pl->first = start;
+	pl->next = start;
+	madvise((void *) pl->rf->map, pl->rf->map_size, MADV_SEQUENTIAL);
+
+	printf("playing %s\n\tframes:\t%lu\n\tindex:\t%c\n", path,
+		pl->rf->n_frames, pl->rf->index ? 'Y' : 'N');
+	if (speed > 0)
+		printf("\tspeed:\t%gx\n", speed);
+	else
+		printf("\tspeed:\tmax\n");
+	return pl;
+}
+
+const struct v4l2_pix_format *player_format(const struct player *pl)
+{
+	return &pl->rf->hdr->pix;
+}
+
+void player_start(struct player *pl, PlayerFrameFunction frame,
+		PlayerDoneFunction done)
+{
+	pl->frame = frame;
+	pl->done = done;
+	pl->start_ns = stats_now();
+	prefetch(pl);
+
+	if (pl->speed <= 0) {
+		pl->source_id = g_idle_add(play_idle, pl);
+		return;
+	}
+
+	pl->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC);
+	if (pl->timer_fd < 0) {
+		perror("timerfd_create");
+		exit(EXIT_FAILURE);
+	}
+	pl->channel = g_io_channel_unix_new(pl->timer_fd);
+	pl->source_id = g_io_add_watch(pl->channel, G_IO_IN,
+			(GIOFunc) play_timer, pl);
+	arm(pl);
+}
+
+void player_close(struct player *pl)
+{
+	double seconds;
+
+	if (!pl)
+		return;
+
+	seconds = (stats_now() - pl->start_ns) / 1e9;
+	printf("played %lu frames in %.2fs (%.1f fps)", pl->played, seconds,
+		seconds > 0 ? pl->played / seconds : 0.0);
+	if (pl->late)
+		printf(", %lu skipped to keep up", pl->late);
+	printf("\n");
+
+	if (pl->source_id)
+		g_source_remove(pl->source_id);
+	if (pl->channel)
+		g_io_channel_unref(pl->channel);
+	if (pl->timer_fd >= 0)
+		close(pl->timer_fd);
+	recfile_close(pl->rf);
+	free(pl);
+}
@@ -0,0 +1,34 @@
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+/*
+ * Plays a recfile into the main loop, at the recorded rate (from the index
+ * timestamps), a multiple of it, or as fast as the display takes frames.
+ * Frames are read straight from the mapping, which is prefetched a few
+ * frames ahead so playback does not wait on the disk.
+ */
+
+typedef void (*PlayerFrameFunction)(unsigned char *p, int len,
+		const struct frame_info *info);
+typedef void (*PlayerDoneFunction)(void);
+
+struct player;
+
+/* speed 0 plays as fast as possible, start is the first frame index */
+struct player *player_open(const char *path, double speed,
+		unsigned long start);
+
+const struct v4l2_pix_format *player_format(const struct player *pl);
+
+/* Adds the playback source to the default main context */
+void player_start(struct player *pl, PlayerFrameFunction frame,
+		PlayerDoneFunction done);
+
+/* Prints what was played, removes the source and unmaps the file */
+void player_close(struct player *pl);
+
+#endif // PLAYER_H
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "probe.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+static int add_mode(struct probe *pr, const struct probe_mode *mode)
+{
+	struct probe_mode *modes;
+
+	modes = realloc(pr->modes, (pr->n_modes + 1) * sizeof(*modes));
+	if (!modes)
+		return -1;
+	pr->modes = modes;
+	pr->modes[pr->n_modes++] = *mode;
+	return 0;
+}
+
+/* a shorter than b */
+static int interval_shorter(const struct v4l2_fract *a,
+		const struct v4l2_fract *b)
+{
+	if (!a->numerator || !a->denominator)
+		return 0;
+	if (!b->numerator || !b->denominator)
+		return 1;
+	return (unsigned long long) a->numerator * b->denominator
+		< (unsigned long long) b->numerator * a->denominator;
+}
+
+/* Stepwise sizes are asked at their largest, usually the slowest */
+static void enum_intervals(const struct capture_source *source, int fd,
+		struct probe_mode *mode)
+{
+	struct v4l2_frmivalenum iv;
+
+	CLEAR(iv);
+	iv.pixel_format = mode->pixelformat;
+	iv.width = mode->max_width;
+	iv.height = mode->max_height;
+	for (iv.index = 0;
+			source->ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &iv) == 0;
+			iv.index++) {
+		if (iv.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+			mode->interval = iv.stepwise.min;
+			break;
+		}
+		if (interval_shorter(&iv.discrete, &mode->interval))
+			mode->interval = iv.discrete;
+	}
+}
+
+static int enum_sizes(struct probe *pr, const struct capture_source *source,
+		int fd, __u32 pixelformat)
+{
+	struct v4l2_frmsizeenum fs;
+	struct probe_mode mode;
+
+	CLEAR(fs);
+	fs.pixel_format = pixelformat;
+	for (fs.index = 0;
+			source->ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fs) == 0;
+			fs.index++) {
+		CLEAR(mode);
+		mode.pixelformat = pixelformat;
+		if (fs.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			mode.min_width = mode.max_width = fs.discrete.width;
+			mode.min_height = mode.max_height = fs.discrete.height;
+			mode.step_width = mode.step_height = 1;
+		} else {
+			mode.min_width = fs.stepwise.min_width;
+			mode.max_width = fs.stepwise.max_width;
+			mode.step_width = fs.stepwise.step_width;
+			mode.min_height = fs.stepwise.min_height;
+			mode.max_height = fs.stepwise.max_height;
+			mode.step_height = fs.stepwise.step_height;
+		}
+		enum_intervals(source, fd, &mode);
+		if (add_mode(pr, &mode) < 0)
+			return -1;
+		if (fs.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+			break;
+	}
+	return 0;
+}
+
+static int enumerate(struct probe *pr, const struct capture_source *source,
+		int fd)
+{
+	struct v4l2_fmtdesc desc;
+
+	CLEAR(desc);
+	desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	/* the formats libv4l only emulates are converted from a native one,
+	which is listed too */
+	for (desc.index = 0;
+			source->ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0;
+			desc.index++) {
+		if (desc.flags & V4L2_FMT_FLAG_EMULATED)
+			continue;
+		if (enum_sizes(pr, source, fd, desc.pixelformat) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void sanitize(char *s)
+{
+	for (; *s; s++)
+		if (!isalnum((unsigned char) *s) && *s != '-' && *s != '.')
+			*s = '_';
+}
+
+/* One file per device node and bus position, the first line names the
+driver, card and driver version and must match for the rest to be used */
+static int cache_names(struct probe *pr, const struct capture_source *source,
+		int fd, const char *dev_name)
+{
+	struct v4l2_capability cap;
+	const char *base;
+	char *key;
+
+	CLEAR(cap);
+	if (source->ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0)
+		return -1;
+
+	base = strrchr(dev_name, '/');
+	key = g_strdup_printf("%s-%.32s", base ? base + 1 : dev_name,
+			(char *) cap.bus_info);
+	sanitize(key);
+	pr->cache_path = g_strdup_printf("%s/svv/probe-%s",
+			g_get_user_cache_dir(), key);
+	pr->cache_id = g_strdup_printf("# svv probe 1 %.16s %.32s %u.%u.%u",
+			(char *) cap.driver, (char *) cap.card,
+			(cap.version >> 16) & 0xff, (cap.version >> 8) & 0xff,
+			cap.version & 0xff);
+	g_free(key);
+	return 0;
+}
+
+static int cache_load(struct probe *pr)
+{
+	struct probe_mode mode;
+	char line[256];
+	FILE *f;
+	int ok;
+
+	f = fopen(pr->cache_path, "r");
+	if (!f)
+		return -1;
+
+	line[0] = '\0';
+	ok = fgets(line, sizeof(line), f) != NULL;
+	line[strcspn(line, "\n")] = '\0';
+	ok = ok && strcmp(line, pr->cache_id) == 0;
+	while (ok && fgets(line, sizeof(line), f)) {
+		CLEAR(mode);
+		if (sscanf(line, "%x %u %u %u %u %u %u %u/%u",
+				&mode.pixelformat,
+				&mode.min_width, &mode.max_width,
+				&mode.step_width, &mode.min_height,
+				&mode.max_height, &mode.step_height,
+				&mode.interval.numerator,
+				&mode.interval.denominator) != 9
+				|| add_mode(pr, &mode) < 0)
+			ok = 0;
+	}
+	fclose(f);
+
+	if (!ok) {
+		free(pr->modes);
+		pr->modes = NULL;
+		pr->n_modes = 0;
+		return -1;
+	}
+	pr->cached = 1;
+	return 0;
+}
+
+static void cache_save(const struct probe *pr)
+{
+	char *dir, *tmp;
+	unsigned int i;
+	FILE *f;
+	int ok;
+
+	dir = g_strdup_printf("%s/svv", g_get_user_cache_dir());
+	tmp = g_strdup_printf("%s.%d", pr->cache_path, (int) getpid());
+	g_mkdir_with_parents(dir, 0755);
+
+	/* written aside and renamed, so that another svv starting on the
+	same device never reads half of it */
+	f = fopen(tmp, "w");
+	if (!f)
+		goto out;
+	fprintf(f, "%s\n", pr->cache_id);
+	for (i = 0; i < pr->n_modes; i++) {
+		const struct probe_mode *m = &pr->modes[i];
+
+		fprintf(f, "%08x %u %u %u %u %u %u %u/%u\n", m->pixelformat,
+			m->min_width, m->max_width, m->step_width,
+			m->min_height, m->max_height, m->step_height,
+			m->interval.numerator, m->interval.denominator);
+	}
+	ok = fclose(f) == 0;
+	if (!ok || rename(tmp, pr->cache_path) < 0)
+		unlink(tmp);
+out:
+	g_free(tmp);
+	g_free(dir);
+}
+
+int probe_device(struct probe *pr, const struct capture_source *source,
+		int fd, const char *dev_name, int use_cache)
+{
+	memset(pr, 0, sizeof(*pr));
+
+	if (cache_names(pr, source, fd, dev_name) < 0)
+		return -1;
+	if (use_cache && cache_load(pr) == 0)
+		return 0;
+
+	if (enumerate(pr, source, fd) < 0)
+		return -1;
+	cache_save(pr);
+	return 0;
+}
+
+/* The size within the mode's range that is nearest to w x h */
+static void fit(const struct probe_mode *m, unsigned int w, unsigned int h,
+		unsigned int *fw, unsigned int *fh)
+{
+	if (w < m->min_width)
+		w = m->min_width;
+	if (w > m->max_width)
+		w = m->max_width;
+	if (h < m->min_height)
+		h = m->min_height;
+	if (h > m->max_height)
+		h = m->max_height;
+	if (m->step_width > 1)
+		w -= (w - m->min_width) % m->step_width;
+	if (m->step_height > 1)
+		h -= (h - m->min_height) % m->step_height;
+	*fw = w;
+	*fh = h;
+}
+
+const struct probe_mode *probe_choose(const struct probe *pr,
+		unsigned int *w, unsigned int *h,
+		ProbeCostFunction cost, void *data)
+{
+	const struct probe_mode *best = NULL;
+	unsigned long long want = (unsigned long long) *w * *h;
+	unsigned long long dist, best_dist = 0;
+	unsigned int fw, fh, c, best_cost = 0, best_w = 0, best_h = 0;
+	unsigned int i;
+
+	for (i = 0; i < pr->n_modes; i++) {
+		const struct probe_mode *m = &pr->modes[i];
+
+		c = cost(m->pixelformat, data);
+		if (c == UINT_MAX)
+			continue;
+		fit(m, *w, *h, &fw, &fh);
+		dist = (unsigned long long) fw * fh;
+		dist = dist > want ? dist - want : want - dist;
+
+		if (best) {
+			if (dist != best_dist) {
+				if (dist > best_dist)
+					continue;
+			} else if (interval_shorter(&best->interval,
+					&m->interval)) {
+				continue;
+			} else if (!interval_shorter(&m->interval,
+					&best->interval) && c >= best_cost) {
+				continue;
+			}
+		}
+		best = m;
+		best_dist = dist;
+		best_cost = c;
+		best_w = fw;
+		best_h = fh;
+	}
+
+	if (best) {
+		*w = best_w;
+		*h = best_h;
+	}
+	return best;
+}
+
+void probe_free(struct probe *pr)
+{
+	free(pr->modes);
+	g_free(pr->cache_path);
+	g_free(pr->cache_id);
+	memset(pr, 0, sizeof(*pr));
+}
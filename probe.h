@@ -0,0 +1,48 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <linux/videodev2.h>
+
+#include "source.h"
+
+/*
+ * What a device can capture natively: every format, frame size and the
+ * shortest frame interval from VIDIOC_ENUM_FMT, ENUM_FRAMESIZES and
+ * ENUM_FRAMEINTERVALS. Enumerating a USB camera takes a round trip per
+ * query, so the result is cached per device under the user cache
+ * directory and a warm start reads it back instead.
+ */
+
+struct probe_mode {
+	__u32           pixelformat;
+	__u32           min_width, max_width, step_width;
+	__u32           min_height, max_height, step_height;
+	struct v4l2_fract interval;	/* shortest, 0/0 if unknown */
+};
+
+struct probe {
+	struct probe_mode *modes;
+	unsigned int    n_modes;
+	int             cached;		/* read back from the cache */
+	char            *cache_path;
+	char            *cache_id;	/* first line, identifies the device */
+};
+
+/* Fills pr from the cache, or by enumerating fd and then saving it.
+use_cache 0 enumerates and overwrites the cache. Returns -1 on error */
+int probe_device(struct probe *pr, const struct capture_source *source,
+		int fd, const char *dev_name, int use_cache);
+
+/* Relative cost of capturing a format, UINT_MAX if it cannot be used */
+typedef unsigned int (*ProbeCostFunction)(__u32 pixelformat, void *data);
+
+/* The mode whose size is nearest w x h, then with the highest frame rate,
+then the cheapest. w and h are changed to the size chosen. NULL if no mode
+has a finite cost */
+const struct probe_mode *probe_choose(const struct probe *pr,
+		unsigned int *w, unsigned int *h,
+		ProbeCostFunction cost, void *data);
+
+void probe_free(struct probe *pr);
+
+#endif // PROBE_H
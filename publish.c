@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "publish.h"
+#include "shmframe.h"
+
+struct publisher {
+	char            path[NAME_MAX];
+	int             fd;
+	unsigned char   *map;
+	size_t          size;
+	struct shmframe_header *hdr;
+	uint64_t        published;
+	unsigned long   truncated;
+};
+
+static size_t round_page(size_t n)
+{
+	size_t page = getpagesize();
+
+	return (n + page - 1) / page * page;
+}
+
+static struct shmframe_slot *slot_at(struct publisher *pub, uint64_t frame)
+{
+	return (struct shmframe_slot *)(pub->map + pub->hdr->header_size
+		+ (frame % pub->hdr->n_slots) * pub->hdr->slot_size);
+}
+
+/* The publisher holds a lock on its segment, which goes away with the
+process. A segment nobody holds was left over by a crash and is replaced,
+one that is held belongs to another svv still publishing under the name */
+static int remove_stale(const char *path)
+{
+	int fd, ret = 0;
+
+	fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return 0;
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		shm_unlink(path);
+	} else if (errno == EWOULDBLOCK) {
+		fprintf(stderr, "publish: %s is being published by another "
+			"svv\n", path);
+		ret = -1;
+	} else {
+		fprintf(stderr, "publish: %s: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+struct publisher *publisher_open(const char *name, unsigned int n_slots,
+		const struct v4l2_pix_format *pix)
+{
+	struct publisher *pub;
+	struct shmframe_header *hdr;
+	size_t header_size, slot_size;
+
+	if (strchr(name, '/')) {
+		fprintf(stderr, "publish: '%s' must not contain '/'\n", name);
+		return NULL;
+	}
+
+	pub = calloc(1, sizeof(*pub));
+	if (!pub)
+		return NULL;
+	snprintf(pub->path, sizeof(pub->path), "/%s", name);
+
+	/* slot data page aligned, so readers can hand it to anything that
+	wants aligned buffers */
+	header_size = round_page(sizeof(struct shmframe_header));
+	slot_size = round_page(sizeof(struct shmframe_slot))
+		+ round_page(pix->sizeimage);
+	pub->size = header_size + n_slots * slot_size;
+
+	if (remove_stale(pub->path) < 0) {
+		free(pub);
+		return NULL;
+	}
+	pub->fd = shm_open(pub->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+			0600);
+	if (pub->fd < 0) {
+		fprintf(stderr, "publish: %s: %s\n", pub->path,
+				strerror(errno));
+		free(pub);
+		return NULL;
+	}
+	/* held until svv exits, however it exits */
+	if (flock(pub->fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "publish: %s: %s\n", pub->path,
+				strerror(errno));
+		goto fail;
+	}
+	if (ftruncate(pub->fd, pub->size) < 0) {
+		fprintf(stderr, "publish: %s: %s\n", pub->path,
+				strerror(errno));
+		goto fail;
+	}
+	pub->map = mmap(NULL, pub->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			pub->fd, 0);
+	if (pub->map == MAP_FAILED) {
+		perror("publish: mmap");
+		goto fail;
+	}
+	/* fault the ring in now rather than on the capture thread */
+	memset(pub->map, 0, pub->size);
+
+	hdr = pub->hdr = (struct shmframe_header *) pub->map;
+	hdr->header_size = header_size;
+	hdr->n_slots = n_slots;
+	hdr->slot_size = slot_size;
+	hdr->slot_header_size = round_page(sizeof(struct shmframe_slot));
+	hdr->width = pix->width;
+	hdr->height = pix->height;
+	hdr->pixelformat = pix->pixelformat;
+	hdr->bytesperline = pix->bytesperline;
+	hdr->sizeimage = pix->sizeimage;
+
+	/* readers check the magic last */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, SHMFRAME_MAGIC, sizeof(hdr->magic));
+
+	fprintf(stderr, "publish: %s, %u slots of %zu KiB\n", pub->path,
+			n_slots, slot_size >> 10);
+	return pub;
+
+fail:
+	close(pub->fd);
+	shm_unlink(pub->path);
+	free(pub);
+	return NULL;
+}
+
+void publisher_push(struct publisher *pub, const void *p, size_t len,
+		const struct frame_info *info)
+{
+	struct shmframe_header *hdr = pub->hdr;
+	struct shmframe_slot *slot = slot_at(pub, pub->published);
+	uint32_t lock = slot->lock;
+
+	if (len > hdr->slot_size - hdr->slot_header_size) {
+		len = hdr->slot_size - hdr->slot_header_size;
+		pub->truncated++;
+	}
+
+	/* seqlock: odd while the slot is written, readers that saw the old
+	value know their data is stale */
+	__atomic_store_n(&slot->lock, lock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((unsigned char *) slot + hdr->slot_header_size, p, len);
+	slot->frame = pub->published;
+	slot->sequence = info->sequence;
+	slot->bytesused = len;
+	slot->timestamp_ns = info->driver_ns;
+
+	__atomic_store_n(&slot->lock, lock + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->published, ++pub->published, __ATOMIC_RELEASE);
+
+	/* the wake is a syscall, skip it while nobody sleeps */
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX,
+				NULL, NULL, 0);
+}
+
+void publisher_close(struct publisher *pub)
+{
+	if (!pub)
+		return;
+
+	/* wake the readers so they see the ring is closed */
+	__atomic_store_n(&pub->hdr->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&pub->hdr->futex, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &pub->hdr->futex, FUTEX_WAKE, INT_MAX,
+			NULL, NULL, 0);
+
+	/* readers keep their mapping until they close it */
+	fprintf(stderr, "publish: %llu frames", (unsigned long long)
+			pub->published);
+	if (pub->truncated)
+		fprintf(stderr, ", %lu truncated", pub->truncated);
+	fprintf(stderr, "\n");
+
+	munmap(pub->map, pub->size);
+	close(pub->fd);
+	shm_unlink(pub->path);
+	free(pub);
+}
@@ -0,0 +1,31 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <stddef.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+/*
+ * --publish, the captured frames in a POSIX shared memory ring that other
+ * processes map and read in place through shmframe.h. Each frame is copied
+ * once, whatever the number of readers, and the capture side never waits
+ * for them: a reader that falls behind finds its slots overwritten.
+ */
+
+struct publisher;
+
+/* Creates /dev/shm/name, replacing a segment left over by a crash but not
+one another svv is still publishing */
+struct publisher *publisher_open(const char *name, unsigned int n_slots,
+		const struct v4l2_pix_format *pix);
+
+/* Capture side, never blocks */
+void publisher_push(struct publisher *pub, const void *p, size_t len,
+		const struct frame_info *info);
+
+/* Marks the ring closed for the readers, unlinks it and prints the count */
+void publisher_close(struct publisher *pub);
+
+#endif // PUBLISH_H
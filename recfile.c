@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recfile.h"
+
+size_t recfile_slot_size(const struct v4l2_pix_format *pix)
+{
+	size_t page = getpagesize();
+
+	return (pix->sizeimage + page - 1) & ~(page - 1);
+}
+
+void recfile_init_header(struct recfile_header *h,
+		const struct v4l2_pix_format *pix)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, RECFILE_MAGIC, sizeof(h->magic));
+	h->header_size = RECFILE_HEADER_SIZE;
+	h->index_entry_size = sizeof(struct recfile_index);
+	h->slot_size = recfile_slot_size(pix);
+	h->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	h->pix = *pix;
+}
+
+int recfile_probe(const char *path)
+{
+	char magic[8];
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	r = read(fd, magic, sizeof(magic));
+	close(fd);
+	if (r < 0)
+		return -1;
+	return r == sizeof(magic)
+		&& memcmp(magic, RECFILE_MAGIC, sizeof(magic)) == 0;
+}
+
+/* Everything recfile_frame() and the index point at must lie inside the
+mapping. Alignment is checked against the smallest page size, which is the
+header size: slots of a larger page system are aligned to it too */
+static int valid_header(const struct recfile_header *h, size_t size)
+{
+	if (h->header_size < sizeof(*h) || h->header_size > size
+			|| h->header_size % RECFILE_HEADER_SIZE
+			|| h->slot_size == 0
+			|| h->slot_size % RECFILE_HEADER_SIZE
+			|| h->slot_size < h->pix.sizeimage
+			|| h->index_entry_size != sizeof(struct recfile_index))
+		return 0;
+	if (!h->index_offset)
+		return 1;
+
+	/* header_size + n_frames * slot_size <= index_offset, written as a
+	division so that it cannot overflow */
+	if (h->index_offset < h->header_size || h->index_offset > size
+			|| h->n_frames > (size - h->index_offset)
+				/ sizeof(struct recfile_index)
+			|| h->n_frames > (h->index_offset - h->header_size)
+				/ h->slot_size)
+		return 0;
+	return 1;
+}
+
+struct recfile *recfile_open(const char *path)
+{
+	struct recfile *rf;
+	const struct recfile_header *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < RECFILE_HEADER_SIZE) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	h = map;
+	if (memcmp(h->magic, RECFILE_MAGIC, sizeof(h->magic)) != 0
+			|| !valid_header(h, st.st_size)) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rf = calloc(1, sizeof(*rf));
+	if (!rf) {
+		munmap(map, st.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	rf->map = map;
+	rf->map_size = st.st_size;
+	rf->hdr = h;
+	if (h->index_offset) {
+		rf->index = (const void *)(rf->map + h->index_offset);
+		rf->n_frames = h->n_frames;
+	} else {
+		/* cut short, keep the complete slots */
+		rf->n_frames = (st.st_size - h->header_size) / h->slot_size;
+	}
+	return rf;
+}
+
+void recfile_close(struct recfile *rf)
+{
+	if (!rf)
+		return;
+	munmap((void *) rf->map, rf->map_size);
+	free(rf);
+}
+
+const unsigned char *recfile_frame(const struct recfile *rf, unsigned long i,
+		size_t *len, struct frame_info *info)
+{
+	const struct recfile_header *h = rf->hdr;
+
+	if (i >= rf->n_frames)
+		return NULL;
+
+	*len = h->pix.sizeimage;
+	if (info)
+		memset(info, 0, sizeof(*info));
+	if (rf->index) {
+		if (rf->index[i].bytesused
+				&& rf->index[i].bytesused < h->pix.sizeimage)
+			*len = rf->index[i].bytesused;
+		if (info) {
+			info->sequence = rf->index[i].sequence;
+			info->driver_ns = rf->index[i].timestamp_ns;
+		}
+	} else if (info) {
+		info->sequence = i;
+	}
+	return rf->map + h->header_size + i * h->slot_size;
+}
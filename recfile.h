@@ -0,0 +1,72 @@
+#ifndef RECFILE_H
+#define RECFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+/*
+ * Recording container, little endian:
+ *
+ *   header page   struct recfile_header, padded to RECFILE_HEADER_SIZE
+ *   frame slots   n_frames x slot_size, frame i at
+ *                 RECFILE_HEADER_SIZE + i * slot_size
+ *   index         n_frames x struct recfile_index, at index_offset
+ *
+ * slot_size is sizeimage rounded up to a page, so every frame is page
+ * aligned in the file and in a mapping of it, and finding one needs no
+ * search. A recording that was not closed has index_offset 0, its frames
+ * are still found from the file size.
+ */
+
+#define RECFILE_MAGIC "SVVREC01"
+#define RECFILE_HEADER_SIZE 4096
+
+struct recfile_header {
+	char            magic[8];
+	uint32_t        header_size;
+	uint32_t        index_entry_size;
+	uint64_t        slot_size;
+	uint64_t        n_frames;
+	uint64_t        index_offset;
+	/* the pix member of the capture v4l2_format; the whole struct holds
+	pointers (v4l2_window) and changes size between ABIs */
+	uint32_t        type;
+	uint32_t        reserved;
+	struct v4l2_pix_format pix;
+};
+
+struct recfile_index {
+	uint64_t        timestamp_ns;	/* driver timestamp, CLOCK_MONOTONIC */
+	uint32_t        sequence;
+	uint32_t        bytesused;
+};
+
+/* Writer side */
+size_t recfile_slot_size(const struct v4l2_pix_format *pix);
+void recfile_init_header(struct recfile_header *h,
+		const struct v4l2_pix_format *pix);
+
+/* Reader side, the whole file is mapped read only */
+struct recfile {
+	const unsigned char *map;
+	size_t          map_size;
+	const struct recfile_header *hdr;
+	const struct recfile_index *index;	/* NULL when not closed */
+	unsigned long   n_frames;
+};
+
+/* 1 if path is a container, 0 if not (raw frames), -1 on errors */
+int recfile_probe(const char *path);
+
+struct recfile *recfile_open(const char *path);
+void recfile_close(struct recfile *rf);
+
+/* Frame i, in O(1). info may be NULL, its times are 0 without an index */
+const unsigned char *recfile_frame(const struct recfile *rf, unsigned long i,
+		size_t *len, struct frame_info *info);
+
+#endif // RECFILE_H
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE	/* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "recorder.h"
+#include "recfile.h"
+#include "stats.h"
+
+#define LOAD(x)         __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* O_DIRECT wants block aligned buffers, offsets and sizes */
+#define RECORD_ALIGN 4096
+#define RECORD_CHUNK (4 << 20)
+#define RECORD_MIN_CHUNKS 4
+#define RECORD_INDEX_INITIAL 4096	/* entries, doubled as needed */
+
+struct recorder {
+	int             fd;
+	int             direct;
+	int             wake_fd;	/* writer wakeup, counts full chunks */
+	pthread_t       writer;
+	unsigned char   *mem;
+	unsigned int    n_chunks;
+	int             failed;		/* write error, set by the writer */
+	int             stopping;
+	struct recfile_header header;
+
+	/* producer only */
+	size_t          fill;		/* bytes in the chunk being filled */
+	uint64_t        frames;
+	uint64_t        dropped;
+	struct recfile_index *index;
+	size_t          index_size;
+
+	/* writer only until the join */
+	uint64_t        written;
+	uint64_t        first_ns;
+	uint64_t        last_ns;
+
+	/* chunks [tail, head) are full and waiting for the writer, head is the
+	one being filled. Written by the producer and the writer respectively */
+	unsigned long   head __attribute__((aligned(64)));
+	unsigned long   tail __attribute__((aligned(64)));
+};
+
+static unsigned char *chunk(struct recorder *rec, unsigned long i)
+{
+	return rec->mem + (size_t)(i % rec->n_chunks) * RECORD_CHUNK;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static void *writer_thread(void *data)
+{
+	struct recorder *rec = data;
+	unsigned long tail;
+	uint64_t v;
+
+	for (;;) {
+		tail = rec->tail;
+		if (tail == LOAD(rec->head)) {
+			if (LOAD(rec->stopping))
+				break;
+			if (read(rec->wake_fd, &v, sizeof(v)) < 0
+					&& errno != EINTR)
+				break;
+			continue;
+		}
+
+		if (!rec->first_ns)
+			rec->first_ns = stats_now();
+		if (!LOAD(rec->failed) && write_all(rec->fd, chunk(rec, tail),
+					RECORD_CHUNK) < 0) {
+			perror("record: write");
+			STORE(rec->failed, 1);
+		}
+		rec->written += RECORD_CHUNK;
+		rec->last_ns = stats_now();
+		STORE(rec->tail, tail + 1);
+	}
+	return NULL;
+}
+
+static void wake_writer(struct recorder *rec)
+{
+	uint64_t one = 1;
+
+	if (write(rec->wake_fd, &one, sizeof(one)) < 0)
+		perror("eventfd write");
+}
+
+/* Copies len bytes (zeroes if src is NULL) into the ring, handing chunks
+to the writer as they fill up. The caller checked there is room */
+static void append(struct recorder *rec, const unsigned char *src, size_t len)
+{
+	unsigned long head = rec->head;
+	size_t n;
+
+	while (len > 0) {
+		n = RECORD_CHUNK - rec->fill;
+		if (n > len)
+			n = len;
+		if (src) {
+			memcpy(chunk(rec, head) + rec->fill, src, n);
+			src += n;
+		} else {
+			memset(chunk(rec, head) + rec->fill, 0, n);
+		}
+		rec->fill += n;
+		len -= n;
+
+		if (rec->fill == RECORD_CHUNK) {
+			STORE(rec->head, ++head);
+			rec->fill = 0;
+			wake_writer(rec);
+		}
+	}
+}
+
+struct recorder *recorder_open(const char *path, size_t buffer_size,
+		const struct v4l2_pix_format *pix)
+{
+	struct recorder *rec;
+
+	if (posix_memalign((void **)&rec, 64, sizeof(*rec)) != 0)
+		return NULL;
+	memset(rec, 0, sizeof(*rec));
+
+	recfile_init_header(&rec->header, pix);
+	rec->n_chunks = buffer_size / RECORD_CHUNK;
+	if (rec->n_chunks < RECORD_MIN_CHUNKS)
+		rec->n_chunks = RECORD_MIN_CHUNKS;
+	/* the ring must hold at least one whole slot */
+	if (rec->header.slot_size > RECORD_CHUNK * (rec->n_chunks - 1))
+		rec->n_chunks = rec->header.slot_size / RECORD_CHUNK + 2;
+
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	rec->direct = rec->fd >= 0;
+	if (rec->fd < 0 && errno == EINVAL)
+		/* tmpfs and friends */
+		rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (rec->fd < 0) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n",
+			path, errno, strerror(errno));
+		free(rec);
+		return NULL;
+	}
+
+	rec->index_size = RECORD_INDEX_INITIAL;
+	rec->index = malloc(rec->index_size * sizeof(*rec->index));
+	rec->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (rec->wake_fd < 0 || !rec->index
+			|| posix_memalign((void **)&rec->mem, RECORD_ALIGN,
+				(size_t)rec->n_chunks * RECORD_CHUNK) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* fault the ring in now rather than on the capture path */
+	memset(rec->mem, 0, (size_t)rec->n_chunks * RECORD_CHUNK);
+
+	/* rewritten with the frame count and index on close */
+	append(rec, (const unsigned char *) &rec->header, sizeof(rec->header));
+	append(rec, NULL, RECFILE_HEADER_SIZE - sizeof(rec->header));
+
+	if (pthread_create(&rec->writer, NULL, writer_thread, rec) != 0) {
+		fprintf(stderr, "Cannot create writer thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("recording to %s\n\tdirect:\t%c\n\tbuffer:\t%u MiB\n", path,
+		rec->direct ? 'Y' : 'N', rec->n_chunks * (RECORD_CHUNK >> 20));
+	return rec;
+}
+
+static int grow_index(struct recorder *rec)
+{
+	struct recfile_index *index;
+
+	index = realloc(rec->index, 2 * rec->index_size * sizeof(*index));
+	if (!index)
+		return -1;
+	rec->index = index;
+	rec->index_size *= 2;
+	return 0;
+}
+
+int recorder_push(struct recorder *rec, const void *p, size_t len,
+		const struct frame_info *info)
+{
+	size_t slot_size = rec->header.slot_size;
+	unsigned long queued;
+	struct recfile_index *entry;
+	size_t room = 0;
+
+	if (len > rec->header.pix.sizeimage)
+		len = rec->header.pix.sizeimage;
+
+	/* the whole slot must fit, partial frames would corrupt the file.
+	With every chunk queued the one at head is still being written */
+	queued = rec->head - LOAD(rec->tail);
+	if (queued < rec->n_chunks)
+		room = RECORD_CHUNK - rec->fill
+			+ (size_t)(rec->n_chunks - 1 - queued) * RECORD_CHUNK;
+	if (slot_size > room || LOAD(rec->failed)
+			|| (rec->frames == rec->index_size && grow_index(rec) < 0)) {
+		rec->dropped++;
+		return -1;
+	}
+
+	append(rec, p, len);
+	append(rec, NULL, slot_size - len);
+
+	entry = &rec->index[rec->frames++];
+	entry->timestamp_ns = info->driver_ns;
+	entry->sequence = info->sequence;
+	entry->bytesused = len;
+	return 0;
+}
+
+/* The last, partial chunk (slots are page multiples, so it can still go
+out direct), then the index and the final header through the page cache */
+static int write_tail(struct recorder *rec)
+{
+	struct recfile_header *h = &rec->header;
+	size_t index_len = rec->frames * sizeof(*rec->index);
+
+	if (write_all(rec->fd, chunk(rec, rec->head), rec->fill) < 0)
+		return -1;
+	rec->written += rec->fill;
+
+	if (rec->direct && fcntl(rec->fd, F_SETFL,
+				fcntl(rec->fd, F_GETFL) & ~O_DIRECT) < 0)
+		return -1;
+	if (write_all(rec->fd, (unsigned char *) rec->index, index_len) < 0)
+		return -1;
+	rec->written += index_len;
+
+	h->n_frames = rec->frames;
+	h->index_offset = RECFILE_HEADER_SIZE + rec->frames * h->slot_size;
+	if (pwrite(rec->fd, h, sizeof(*h), 0) != sizeof(*h))
+		return -1;
+	return 0;
+}
+
+void recorder_close(struct recorder *rec)
+{
+	double seconds;
+
+	if (!rec)
+		return;
+
+	STORE(rec->stopping, 1);
+	wake_writer(rec);
+	pthread_join(rec->writer, NULL);
+
+	/* the rate covers the whole recording, from the writer's first
+	chunk to the tail and index written here. A recording too short to
+	fill a chunk starts with the tail */
+	if (!rec->first_ns)
+		rec->first_ns = stats_now();
+	if (!rec->failed && write_tail(rec) < 0) {
+		perror("record: write");
+		rec->failed = 1;
+	}
+	rec->last_ns = stats_now();
+	seconds = (rec->last_ns - rec->first_ns) / 1e9;
+	if (close(rec->fd) < 0 && !rec->failed) {
+		perror("record: close");
+		rec->failed = 1;
+	}
+	close(rec->wake_fd);
+
+	printf("recorded %llu frames, %llu MiB", (unsigned long long) rec->frames,
+		(unsigned long long) (rec->written >> 20));
+	if (seconds > 0)
+		printf(", %.1f MB/s sustained", rec->written / seconds / 1e6);
+	printf(", %llu dropped%s\n", (unsigned long long) rec->dropped,
+		rec->failed ? ", write error" : "");
+
+	free(rec->index);
+	free(rec->mem);
+	free(rec);
+}
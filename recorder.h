@@ -0,0 +1,31 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stddef.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+/*
+ * Continuous recording into a recfile container. The capture side only
+ * copies each frame into its slot in a preallocated ring of chunks, a
+ * writer thread streams full chunks to disk with O_DIRECT. When the disk
+ * falls behind and the ring is full, frames are dropped rather than
+ * stalling capture.
+ */
+
+struct recorder;
+
+struct recorder *recorder_open(const char *path, size_t buffer_size,
+		const struct v4l2_pix_format *pix);
+
+/* Capture side, never blocks. Returns 0 if the frame was queued, -1 if it
+was dropped */
+int recorder_push(struct recorder *rec, const void *p, size_t len,
+		const struct frame_info *info);
+
+/* Flushes what is queued, stops the writer and prints the throughput */
+void recorder_close(struct recorder *rec);
+
+#endif // RECORDER_H
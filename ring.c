@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+#define LOAD(x)         __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define CAS(x, o, n)    __atomic_compare_exchange_n(&(x), &(o), (n), 0, \
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+static void signal_fd(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+static void drain_fd(int fd)
+{
+	uint64_t v;
+
+	if (read(fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+}
+
+struct ring *ring_new(unsigned int n_slots, size_t slot_size,
+		enum ring_policy policy)
+{
+	struct ring *r;
+	unsigned int i;
+
+	if (n_slots < 2)
+		n_slots = 2;
+
+	if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0)
+		return NULL;
+	memset(r, 0, sizeof(*r));
+
+	r->n_slots = n_slots;
+	r->slot_size = slot_size;
+	r->policy = policy;
+	r->slots = calloc(n_slots, sizeof(*r->slots));
+	if (posix_memalign((void **)&r->mem, getpagesize(),
+			n_slots * slot_size) != 0)
+		r->mem = NULL;
+
+	r->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (!r->slots || !r->mem || r->data_fd < 0 || r->space_fd < 0) {
+		ring_free(r);
+		return NULL;
+	}
+
+	for (i = 0; i < n_slots; ++i)
+		r->slots[i].data = r->mem + i * slot_size;
+
+	return r;
+}
+
+void ring_free(struct ring *r)
+{
+	if (!r)
+		return;
+	if (r->data_fd >= 0)
+		close(r->data_fd);
+	if (r->space_fd >= 0)
+		close(r->space_fd);
+	free(r->mem);
+	free(r->slots);
+	free(r);
+}
+
+static int wait_for_space(struct ring *r, unsigned long head)
+{
+	struct pollfd pfd;
+
+	pfd.fd = r->space_fd;
+	pfd.events = POLLIN;
+
+	while (head - LOAD(r->tail) >= r->n_slots) {
+		if (LOAD(r->stopping))
+			return -1;
+		if (poll(&pfd, 1, 100) > 0)
+			drain_fd(r->space_fd);
+	}
+	return 0;
+}
+
+int ring_push(struct ring *r, const void *p, size_t len,
+		const struct frame_info *info)
+{
+	struct ring_slot *slot;
+	unsigned long head, tail;
+
+	if (len > r->slot_size)
+		return -1;
+
+	head = r->head;
+	tail = LOAD(r->tail);
+
+	if (head - tail >= r->n_slots) {
+		if (r->policy == RING_BLOCK) {
+			if (wait_for_space(r, head) < 0)
+				return -1;
+		} else {
+			/* Claim the oldest frame. If the consumer took it
+			first the CAS fails, and that freed the slot anyway */
+			if (CAS(r->tail, tail, tail + 1))
+				__atomic_add_fetch(&r->dropped, 1,
+						__ATOMIC_RELAXED);
+		}
+	}
+
+	slot = &r->slots[head % r->n_slots];
+	memcpy(slot->data, p, len);
+	slot->len = len;
+	slot->info = *info;
+
+	STORE(r->head, head + 1);
+	signal_fd(r->data_fd);
+	return 0;
+}
+
+size_t ring_pop(struct ring *r, void *dst, struct frame_info *info)
+{
+	struct ring_slot *slot;
+	unsigned long tail;
+	size_t len;
+
+	for (;;) {
+		tail = LOAD(r->tail);
+		if (tail == LOAD(r->head))
+			return 0;
+
+		slot = &r->slots[tail % r->n_slots];
+		len = slot->len;
+		if (len > r->slot_size)
+			len = r->slot_size;
+		memcpy(dst, slot->data, len);
+		*info = slot->info;
+
+		/* The producer only overwrites a queued slot after moving
+		tail past it, so if the CAS succeeds the copy is intact */
+		if (CAS(r->tail, tail, tail + 1))
+			break;
+	}
+
+	if (r->policy == RING_BLOCK)
+		signal_fd(r->space_fd);
+	return len;
+}
+
+struct ring_slot *ring_peek(struct ring *r)
+{
+	unsigned long tail = r->tail;
+
+	if (tail == LOAD(r->head))
+		return NULL;
+	return &r->slots[tail % r->n_slots];
+}
+
+void ring_release(struct ring *r)
+{
+	STORE(r->tail, r->tail + 1);
+	signal_fd(r->space_fd);
+}
+
+void ring_ack(struct ring *r)
+{
+	drain_fd(r->data_fd);
+}
+
+void ring_stop(struct ring *r)
+{
+	STORE(r->stopping, 1);
+	signal_fd(r->space_fd);
+}
@@ -0,0 +1,69 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+#include "frame.h"
+
+/*
+ * Single-producer/single-consumer frame ring. The producer (capture thread)
+ * copies each frame into a preallocated slot, the consumer (main loop)
+ * drains them. Neither side takes a lock.
+ */
+
+enum ring_policy {
+	RING_DROP_OLDEST,	/* producer overwrites the oldest queued frame */
+	RING_BLOCK,		/* producer waits for the consumer */
+};
+
+struct ring_slot {
+	unsigned char   *data;
+	size_t          len;
+	struct frame_info info;
+};
+
+struct ring {
+	struct ring_slot *slots;
+	unsigned char   *mem;
+	unsigned int    n_slots;
+	size_t          slot_size;
+	enum ring_policy policy;
+	int             data_fd;	/* readable while frames are queued */
+	int             space_fd;	/* signalled when a slot is freed */
+	int             stopping;
+	unsigned long   dropped;
+
+	/* head is only written by the producer, tail by the consumer (and
+	by the producer when it drops the oldest frame) */
+	unsigned long   head __attribute__((aligned(64)));
+	unsigned long   tail __attribute__((aligned(64)));
+};
+
+struct ring *ring_new(unsigned int n_slots, size_t slot_size,
+		enum ring_policy policy);
+
+void ring_free(struct ring *r);
+
+/* Producer side. Returns 0 if the frame was queued, -1 if it was not
+(ring stopped or frame too large) */
+int ring_push(struct ring *r, const void *p, size_t len,
+		const struct frame_info *info);
+
+/* Consumer side, any policy. Copies the oldest frame into dst (which must
+hold slot_size bytes) and its info, returns its length or 0 if the ring is
+empty */
+size_t ring_pop(struct ring *r, void *dst, struct frame_info *info);
+
+/* Consumer side, RING_BLOCK only. Returns the oldest slot without
+copying it, or NULL. The slot stays valid until ring_release() */
+struct ring_slot *ring_peek(struct ring *r);
+
+void ring_release(struct ring *r);
+
+/* Clears the data_fd wakeup, call before draining */
+void ring_ack(struct ring *r);
+
+/* Wakes a producer blocked in ring_push() and makes it give up */
+void ring_stop(struct ring *r);
+
+#endif // RING_H
@@ -0,0 +1,230 @@
+#ifndef SHMFRAME_H
+#define SHMFRAME_H
+
+/*
+ * Frames published by `svv --publish name` in POSIX shared memory, and a
+ * header-only API to read them in place. svv copies every captured frame
+ * once into the next slot of a ring and never waits for readers. Each
+ * slot is guarded by a seqlock, so a reader that falls behind notices the
+ * slot was overwritten instead of blocking the publisher:
+ *
+ *	struct shmframe_reader r;
+ *	struct shmframe_frame f;
+ *
+ *	shmframe_open(&r, "cam0");
+ *	while (shmframe_wait(&r, 1000) >= 0)
+ *		while (shmframe_next(&r, &f) == 0) {
+ *			analyse(f.data, f.bytesused);
+ *			if (!shmframe_valid(&f))
+ *				discard the result, the frame changed under us
+ *		}
+ *	shmframe_close(&r);
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHMFRAME_MAGIC "SVVSHM01"
+
+struct shmframe_header {
+	char            magic[8];
+	uint32_t        header_size;	/* offset of the first slot */
+	uint32_t        n_slots;
+	uint64_t        slot_size;	/* stride between slots */
+	uint32_t        slot_header_size; /* data follows the slot header */
+
+	/* the V4L2 format of the frames */
+	uint32_t        width;
+	uint32_t        height;
+	uint32_t        pixelformat;
+	uint32_t        bytesperline;
+	uint32_t        sizeimage;
+
+	uint32_t        closed;		/* svv exited, no more frames */
+	uint32_t        waiters;	/* readers in shmframe_wait() */
+	uint32_t        futex;		/* bumped with every frame */
+	uint32_t        reserved;
+	uint64_t        published;	/* frames written so far */
+};
+
+struct shmframe_slot {
+	uint32_t        lock;		/* seqlock, odd while being written */
+	uint32_t        sequence;	/* V4L2 sequence */
+	uint32_t        bytesused;
+	uint32_t        reserved;
+	uint64_t        frame;		/* number of the frame, from 0 */
+	uint64_t        timestamp_ns;	/* driver, CLOCK_MONOTONIC */
+};
+
+struct shmframe_reader {
+	int             fd;
+	unsigned char   *map;
+	size_t          size;
+	const struct shmframe_header *hdr;
+	uint64_t        next;		/* frame number to read next */
+	uint64_t        lost;		/* frames overwritten before read */
+};
+
+struct shmframe_frame {
+	const unsigned char *data;	/* in the shared mapping, no copy */
+	uint32_t        bytesused;
+	uint32_t        sequence;
+	uint64_t        frame;
+	uint64_t        timestamp_ns;
+
+	/* private */
+	const struct shmframe_slot *slot;
+	uint32_t        lock;
+};
+
+static inline const struct shmframe_slot *
+shmframe_slot(const struct shmframe_reader *r, uint64_t frame)
+{
+	return (const struct shmframe_slot *)(r->map + r->hdr->header_size
+		+ (frame % r->hdr->n_slots) * r->hdr->slot_size);
+}
+
+/* Maps the frames svv publishes as name. Returns 0, -1 with errno set */
+static inline int shmframe_open(struct shmframe_reader *r, const char *name)
+{
+	char path[NAME_MAX];
+	struct stat st;
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	snprintf(path, sizeof(path), "/%s", name);
+	r->fd = shm_open(path, O_RDWR, 0);
+	if (r->fd < 0)
+		return -1;
+	if (fstat(r->fd, &st) < 0
+			|| (size_t) st.st_size < sizeof(struct shmframe_header)) {
+		errno = EAGAIN;
+		goto fail;
+	}
+
+	/* writable only for the futex and waiter count */
+	r->size = st.st_size;
+	r->map = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			r->fd, 0);
+	if (r->map == MAP_FAILED)
+		goto fail;
+	r->hdr = (const struct shmframe_header *) r->map;
+	if (memcmp(r->hdr->magic, SHMFRAME_MAGIC, 8) != 0
+			|| r->hdr->header_size + (uint64_t) r->hdr->n_slots
+				* r->hdr->slot_size > r->size) {
+		/* svv is still setting it up */
+		munmap(r->map, r->size);
+		errno = EAGAIN;
+		goto fail;
+	}
+
+	/* start with the newest frame */
+	r->next = __atomic_load_n(&r->hdr->published, __ATOMIC_ACQUIRE);
+	if (r->next)
+		r->next--;
+	return 0;
+
+fail:
+	ret = errno;
+	close(r->fd);
+	r->fd = -1;
+	errno = ret;
+	return -1;
+}
+
+static inline void shmframe_close(struct shmframe_reader *r)
+{
+	if (r->map && r->map != MAP_FAILED)
+		munmap(r->map, r->size);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->map = NULL;
+	r->fd = -1;
+}
+
+/* Takes the next unread frame, skipping those already overwritten.
+Returns 0, or -1 when there is nothing new */
+static inline int shmframe_next(struct shmframe_reader *r,
+		struct shmframe_frame *f)
+{
+	uint64_t published;
+	const struct shmframe_slot *slot;
+
+	for (;;) {
+		published = __atomic_load_n(&r->hdr->published,
+				__ATOMIC_ACQUIRE);
+		if (r->next >= published)
+			return -1;
+		if (published - r->next > r->hdr->n_slots - 1) {
+			r->lost += published - r->next - (r->hdr->n_slots - 1);
+			r->next = published - (r->hdr->n_slots - 1);
+		}
+
+		slot = shmframe_slot(r, r->next);
+		f->lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+		f->frame = slot->frame;
+		f->sequence = slot->sequence;
+		f->bytesused = slot->bytesused;
+		f->timestamp_ns = slot->timestamp_ns;
+		f->data = (const unsigned char *) slot
+			+ r->hdr->slot_header_size;
+		f->slot = slot;
+
+		/* overwritten since published was read, try again */
+		if ((f->lock & 1) || f->frame != r->next
+				|| f->bytesused > r->hdr->slot_size
+					- r->hdr->slot_header_size) {
+			r->lost++;
+			r->next++;
+			continue;
+		}
+		r->next++;
+		return 0;
+	}
+}
+
+/* 1 if nothing was written to the frame since shmframe_next(), call it
+after using the data */
+static inline int shmframe_valid(const struct shmframe_frame *f)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&f->slot->lock, __ATOMIC_RELAXED) == f->lock;
+}
+
+/* Sleeps until a frame newer than the last one read is published.
+Returns 0, 1 on timeout, -1 once svv has closed the ring */
+static inline int shmframe_wait(struct shmframe_reader *r, int timeout_ms)
+{
+	struct shmframe_header *hdr = (struct shmframe_header *) r->map;
+	struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+	uint32_t futex;
+	int ret = 0;
+
+	__atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+	futex = __atomic_load_n(&hdr->futex, __ATOMIC_SEQ_CST);
+	if (r->next >= __atomic_load_n(&hdr->published, __ATOMIC_ACQUIRE)
+			&& !__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE)) {
+		if (syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, futex,
+				timeout_ms < 0 ? NULL : &ts, NULL, 0) < 0
+				&& errno == ETIMEDOUT)
+			ret = 1;
+	}
+	__atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+
+	if (r->next >= __atomic_load_n(&hdr->published, __ATOMIC_ACQUIRE)
+			&& __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+		return -1;
+	return ret;
+}
+
+#endif // SHMFRAME_H
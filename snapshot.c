@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <glib.h>
+#ifdef HAVE_GDK_PIXBUF
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#endif
+
+#include "snapshot.h"
+#include "convert.h"
+
+#define SNAPSHOT_WORKERS 4
+#define SNAPSHOT_MAX_MEMORY (1024 << 20)	/* frame copies of a burst */
+#define SNAPSHOT_JPEG_QUALITY "90"
+
+static const char *format_names[] = {
+	[SNAPSHOT_PPM] = "ppm",
+	[SNAPSHOT_PNG] = "png",
+	[SNAPSHOT_JPEG] = "jpeg",
+};
+
+struct snapshot_job {
+	unsigned char   *data;		/* the captured frame */
+	struct frame_info info;
+	struct timespec wall;		/* names the file */
+};
+
+struct snapshot {
+	enum snapshot_format format;
+	struct v4l2_pix_format pix;
+	unsigned int    burst;
+	GThreadPool     *pool;
+	GAsyncQueue     *free_jobs;
+	struct snapshot_job *jobs;
+	unsigned int    n_jobs;
+	/* conversion scratch, w * h * 4, one per worker */
+	GAsyncQueue     *free_scratch;
+	unsigned char   *scratch[SNAPSHOT_WORKERS];
+
+	unsigned int    pending;	/* frames left in the current burst */
+	unsigned long   written;
+	unsigned long   dropped;
+	unsigned long   failed;
+};
+
+int snapshot_format_from_name(const char *name, enum snapshot_format *format)
+{
+	if (strcmp(name, "ppm") == 0) {
+		*format = SNAPSHOT_PPM;
+		return 0;
+	}
+#ifdef HAVE_GDK_PIXBUF
+	if (strcmp(name, "png") == 0) {
+		*format = SNAPSHOT_PNG;
+		return 0;
+	}
+	if (strcmp(name, "jpeg") == 0 || strcmp(name, "jpg") == 0) {
+		*format = SNAPSHOT_JPEG;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/* Packs the RGBX conversion to RGB24 in place */
+static void pack_rgb24(unsigned char *p, int npixels)
+{
+	int i;
+
+	for (i = 0; i < npixels; i++) {
+		p[i * 3 + 0] = p[i * 4 + 0];
+		p[i * 3 + 1] = p[i * 4 + 1];
+		p[i * 3 + 2] = p[i * 4 + 2];
+	}
+}
+
+static int write_ppm(const char *path, const unsigned char *rgb, int w, int h)
+{
+	FILE *f;
+	int ok;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -1;
+	fprintf(f, "P6\n%d %d\n255\n", w, h);
+	ok = fwrite(rgb, w * 3, h, f) == (size_t) h;
+	if (fclose(f) != 0)
+		ok = 0;
+	return ok ? 0 : -1;
+}
+
+#ifdef HAVE_GDK_PIXBUF
+static int write_pixbuf(const char *path, const unsigned char *rgb, int w,
+		int h, enum snapshot_format format)
+{
+	GdkPixbuf *pb;
+	GError *err = NULL;
+	gboolean ok;
+
+	pb = gdk_pixbuf_new_from_data(rgb, GDK_COLORSPACE_RGB, FALSE, 8,
+			w, h, w * 3, NULL, NULL);
+	if (format == SNAPSHOT_JPEG)
+		ok = gdk_pixbuf_save(pb, path, "jpeg", &err,
+				"quality", SNAPSHOT_JPEG_QUALITY, NULL);
+	else
+		ok = gdk_pixbuf_save(pb, path, "png", &err, NULL);
+	g_object_unref(pb);
+
+	if (!ok) {
+		fprintf(stderr, "%s: %s\n", path, err->message);
+		g_error_free(err);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static void encode_job(gpointer data, gpointer user_data)
+{
+	struct snapshot_job *job = data;
+	struct snapshot *snap = user_data;
+	const struct v4l2_pix_format *pix = &snap->pix;
+	char path[80], stamp[32];
+	unsigned char *rgb;
+	struct tm tm;
+	int r;
+
+	localtime_r(&job->wall.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(path, sizeof(path), "svv-%s.%06ld-%u.%s", stamp,
+		job->wall.tv_nsec / 1000, job->info.sequence,
+		format_names[snap->format]);
+
+	/* never waits, there are as many as workers */
+	rgb = g_async_queue_pop(snap->free_scratch);
+	conv_frame_to_32(pix->pixelformat, job->data, pix->bytesperline,
+			rgb, pix->width * 4, pix->width, pix->height,
+			CONV_ORDER_RGBX);
+	pack_rgb24(rgb, pix->width * pix->height);
+
+#ifdef HAVE_GDK_PIXBUF
+	if (snap->format != SNAPSHOT_PPM)
+		r = write_pixbuf(path, rgb, pix->width, pix->height,
+				snap->format);
+	else
+#endif
+		r = write_ppm(path, rgb, pix->width, pix->height);
+	g_async_queue_push(snap->free_scratch, rgb);
+
+	if (r < 0) {
+		perror(path);
+		__atomic_add_fetch(&snap->failed, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&snap->written, 1, __ATOMIC_RELAXED);
+	}
+
+	g_async_queue_push(snap->free_jobs, job);
+}
+
+struct snapshot *snapshot_new(enum snapshot_format format, unsigned int burst,
+		const struct v4l2_pix_format *pix)
+{
+	struct snapshot *snap;
+	struct snapshot_job *job;
+	unsigned int i, max_burst;
+
+	if (!conv_supported(pix->pixelformat)) {
+		fprintf(stderr, "Cannot save snapshots of this pixel format\n");
+		return NULL;
+	}
+	max_burst = pix->sizeimage ? SNAPSHOT_MAX_MEMORY / pix->sizeimage : 0;
+	max_burst = max_burst > SNAPSHOT_WORKERS
+		? max_burst - SNAPSHOT_WORKERS : 0;
+	if (burst > max_burst) {
+		fprintf(stderr, "A burst of %u %ux%u frames does not fit in "
+			"%d MiB, at most %u do\n", burst, pix->width,
+			pix->height, SNAPSHOT_MAX_MEMORY >> 20, max_burst);
+		return NULL;
+	}
+	/* the kernel is picked lazily, not by several workers at once */
+	conv_impl_name();
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		goto oom;
+	snap->format = format;
+	snap->pix = *pix;
+	snap->burst = burst;
+	snap->free_jobs = g_async_queue_new();
+	snap->free_scratch = g_async_queue_new();
+
+	snap->n_jobs = burst + SNAPSHOT_WORKERS;
+	snap->jobs = calloc(snap->n_jobs, sizeof(*snap->jobs));
+	if (!snap->jobs)
+		goto oom;
+	for (i = 0; i < snap->n_jobs; i++) {
+		job = &snap->jobs[i];
+		job->data = malloc(pix->sizeimage);
+		if (!job->data)
+			goto oom;
+		g_async_queue_push(snap->free_jobs, job);
+	}
+	for (i = 0; i < SNAPSHOT_WORKERS; i++) {
+		snap->scratch[i] = malloc((size_t) pix->width * pix->height * 4);
+		if (!snap->scratch[i])
+			goto oom;
+		g_async_queue_push(snap->free_scratch, snap->scratch[i]);
+	}
+
+	snap->pool = g_thread_pool_new(encode_job, snap, SNAPSHOT_WORKERS,
+			FALSE, NULL);
+	if (!snap->pool)
+		goto oom;
+	return snap;
+
+oom:
+	fprintf(stderr, "Out of memory\n");
+	snapshot_free(snap);
+	return NULL;
+}
+
+void snapshot_trigger(struct snapshot *snap)
+{
+	__atomic_store_n(&snap->pending, snap->burst, __ATOMIC_RELEASE);
+}
+
+int snapshot_push(struct snapshot *snap, const void *p, size_t len,
+		const struct frame_info *info)
+{
+	struct snapshot_job *job;
+	unsigned int pending;
+
+	pending = __atomic_load_n(&snap->pending, __ATOMIC_ACQUIRE);
+	do {
+		if (pending == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&snap->pending, &pending,
+			pending - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	job = g_async_queue_try_pop(snap->free_jobs);
+	if (!job || len > snap->pix.sizeimage) {
+		if (job)
+			g_async_queue_push(snap->free_jobs, job);
+		__atomic_add_fetch(&snap->dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	memcpy(job->data, p, len);
+	job->info = *info;
+	clock_gettime(CLOCK_REALTIME, &job->wall);
+
+	g_thread_pool_push(snap->pool, job, NULL);
+	return 1;
+}
+
+void snapshot_free(struct snapshot *snap)
+{
+	unsigned int i;
+
+	if (!snap)
+		return;
+
+	if (snap->pool) {
+		/* runs the queued jobs, then joins the workers */
+		g_thread_pool_free(snap->pool, FALSE, TRUE);
+		if (snap->written || snap->dropped || snap->failed)
+			printf("snapshots: %lu written, %lu dropped, "
+				"%lu failed\n", snap->written, snap->dropped,
+				snap->failed);
+	}
+
+	if (snap->jobs) {
+		for (i = 0; i < snap->n_jobs; i++)
+			free(snap->jobs[i].data);
+		free(snap->jobs);
+	}
+	for (i = 0; i < SNAPSHOT_WORKERS; i++)
+		free(snap->scratch[i]);
+	if (snap->free_jobs)
+		g_async_queue_unref(snap->free_jobs);
+	if (snap->free_scratch)
+		g_async_queue_unref(snap->free_scratch);
+	free(snap);
+}
@@ -0,0 +1,45 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+/*
+ * Snapshots and bursts. The capture side copies a requested frame into a
+ * preallocated buffer and hands it to a thread pool, which converts and
+ * encodes it (PPM, or PNG and JPEG through gdk-pixbuf) into a file named
+ * after the capture time. When every buffer is still being encoded the
+ * frame is dropped rather than stalling capture.
+ */
+
+enum snapshot_format {
+	SNAPSHOT_PPM,
+	SNAPSHOT_PNG,
+	SNAPSHOT_JPEG,
+};
+
+struct snapshot;
+
+/* Returns -1 if the name is unknown or not compiled in */
+int snapshot_format_from_name(const char *name, enum snapshot_format *format);
+
+/* Frame copies are preallocated for a whole burst plus one per worker, and
+a conversion buffer per worker. Fails with a message if the copies would
+take more than 1 GiB */
+struct snapshot *snapshot_new(enum snapshot_format format, unsigned int burst,
+		const struct v4l2_pix_format *pix);
+
+/* Any thread. Saves the next burst frames that are pushed */
+void snapshot_trigger(struct snapshot *snap);
+
+/* Capture side, never blocks. Returns 1 if the frame was taken */
+int snapshot_push(struct snapshot *snap, const void *p, size_t len,
+		const struct frame_info *info);
+
+/* Waits for the queued frames to be written and prints the counts */
+void snapshot_free(struct snapshot *snap);
+
+#endif // SNAPSHOT_H
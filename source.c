@@ -0,0 +1,34 @@
+#include <string.h>
+
+#include <libv4l2.h>
+
+#include "source.h"
+
+static int v4l2_source_open(const char *dev_name, int flags)
+{
+	return v4l2_open(dev_name, flags, 0);
+}
+
+static int v4l2_source_ioctl(int fd, unsigned long request, void *arg)
+{
+	return v4l2_ioctl(fd, request, arg);
+}
+
+const struct capture_source v4l2_source = {
+	.name = "v4l2",
+	.is_v4l2 = 1,
+	.open = v4l2_source_open,
+	.close = v4l2_close,
+	.ioctl = v4l2_source_ioctl,
+	.read = v4l2_read,
+	.mmap = v4l2_mmap,
+	.munmap = v4l2_munmap,
+};
+
+const struct capture_source *source_for_device(const char *dev_name)
+{
+	if (strncmp(dev_name, "synth", 5) == 0
+			|| strncmp(dev_name, "replay:", 7) == 0)
+		return &synth_source;
+	return &v4l2_source;
+}
@@ -0,0 +1,35 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Where frames come from. Every source follows the libv4l2 calling
+ * conventions (and V4L2 read/mmap/userptr semantics), so the capture code
+ * does not care whether it talks to a real device or to an emulation.
+ */
+struct capture_source {
+	const char      *name;
+	int             is_v4l2;	/* a real device driven through libv4l */
+	int             (*open)(const char *dev_name, int flags);
+	int             (*close)(int fd);
+	int             (*ioctl)(int fd, unsigned long request, void *arg);
+	ssize_t         (*read)(int fd, void *buf, size_t len);
+	void            *(*mmap)(void *start, size_t length, int prot,
+				int flags, int fd, int64_t offset);
+	int             (*munmap)(void *start, size_t length);
+};
+
+extern const struct capture_source v4l2_source;
+
+/* Generated test pattern ("synth[@fps]") or frames replayed from a
+recording, or from a raw file of back to back images in the negotiated
+format ("replay:file[@fps]"). fps 0 produces frames as fast as buffers are
+queued */
+extern const struct capture_source synth_source;
+
+/* Picks the source handling dev_name */
+const struct capture_source *source_for_device(const char *dev_name);
+
+#endif // SOURCE_H
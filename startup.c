@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "startup.h"
+#include "stats.h"
+#include "trace.h"
+
+#define STARTUP_MAX_PHASES 64
+
+struct startup_phase {
+	const char      *name;
+	uint64_t        start;
+	uint64_t        end;
+	int             on_main;
+};
+
+static uint64_t start_ns;
+static pthread_t main_thread;
+static int profile;
+static int done;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct startup_phase phases[STARTUP_MAX_PHASES];
+static unsigned int n_phases;
+
+void startup_begin(void)
+{
+	start_ns = stats_now();
+	main_thread = pthread_self();
+	stats_set_start(start_ns);
+
+	/* a --bench child starts over from what its parent recorded */
+	pthread_mutex_lock(&lock);
+	n_phases = 0;
+	done = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+void startup_enable_profile(void)
+{
+	profile = 1;
+}
+
+void startup_phase(const char *name, uint64_t start)
+{
+	uint64_t end = stats_now();
+
+	if (trace_enabled)
+		trace_end(name, 0, start);
+	if (!profile)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (n_phases < STARTUP_MAX_PHASES) {
+		phases[n_phases].name = name;
+		phases[n_phases].start = start;
+		phases[n_phases].end = end;
+		phases[n_phases].on_main = pthread_equal(pthread_self(),
+				main_thread);
+		n_phases++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void startup_first_frame(void)
+{
+	unsigned int i;
+
+	if (done || !stats_first_frame_ns())
+		return;
+	done = 1;
+	if (!profile)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	/* in the order they started, the threads interleave */
+	for (i = 1; i < n_phases; i++) {
+		struct startup_phase p = phases[i];
+		unsigned int j = i;
+
+		for (; j > 0 && phases[j - 1].start > p.start; j--)
+			phases[j] = phases[j - 1];
+		phases[j] = p;
+	}
+
+	printf("startup (ms)        at     took\n");
+	for (i = 0; i < n_phases; i++)
+		printf("  %-12s %8.1f %8.1f   %s\n", phases[i].name,
+			(phases[i].start - start_ns) / 1e6,
+			(phases[i].end - phases[i].start) / 1e6,
+			phases[i].on_main ? "main" : "setup");
+	printf("  %-12s %8.1f\n", "first frame",
+		stats_first_frame_ns() / 1e6);
+	pthread_mutex_unlock(&lock);
+	fflush(stdout);
+}
@@ -0,0 +1,26 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdint.h>
+
+/*
+ * --startup-profile, how long each step from main() to the first displayed
+ * frame took and on which thread. The devices are set up on their own
+ * thread while the display connects, so the steps add up to more than the
+ * time to first frame.
+ */
+
+/* Call first thing in main(), the calling thread is "main", and again in
+each --bench child. Also starts the time to first frame in the stats */
+void startup_begin(void);
+
+void startup_enable_profile(void);
+
+/* Any thread. Records the step from start to now, name must be a literal */
+void startup_phase(const char *name, uint64_t start);
+
+/* Main loop, after each displayed frame. Prints the profile once the
+first one is out */
+void startup_first_frame(void);
+
+#endif // STARTUP_H
@@ -0,0 +1,373 @@
+#include <time.h>
+
+#include "histogram.h"
+#include "stats.h"
+
+enum {
+	STAGE_CAPTURE,		/* driver timestamp to dequeue */
+	STAGE_CONVERT,		/* dequeue to end of conversion */
+	STAGE_SUBMIT,		/* end of conversion to display submit */
+	STAGE_TOTAL,		/* driver timestamp to display submit */
+	STAGE_SCANOUT,		/* driver timestamp to presentation */
+	N_STAGES
+};
+
+static const char *stage_names[N_STAGES] = {
+	"capture", "convert", "submit", "total", "scanout"
+};
+
+static struct histogram stages[N_STAGES];
+
+/* written by the capture threads */
+static uint64_t frames_captured;
+static uint64_t driver_dropped;
+static uint64_t frames_decimated;
+
+/* main loop */
+static struct frame_info current;
+static size_t current_len;
+static uint64_t converted_ns;
+static int skipped;
+static uint64_t frames_displayed;
+static uint64_t frames_skipped;
+static uint64_t frames_presented;
+static uint64_t frames_discarded;
+static uint64_t frames_replaced;
+static uint64_t frames_late;
+static uint64_t missed_vblanks;
+static uint64_t bytes_converted;
+
+/* time to first frame, handed to the display and on screen */
+static uint64_t start_ns;
+static uint64_t first_frame_ns;
+static uint64_t first_presented_ns;
+
+/* rates over the last whole second, updated as frames are displayed */
+#define RATE_WINDOW_NS 1000000000ULL
+static uint64_t rate_start_ns;
+static uint64_t rate_captured;
+static uint64_t rate_displayed;
+static uint64_t rate_bytes;
+static double capture_fps;
+static double display_fps;
+static double convert_bytes_per_s;
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account_gap(struct stats_sequence *seq, uint32_t sequence)
+{
+	if (seq->valid && sequence > seq->last + 1)
+		__atomic_add_fetch(&driver_dropped,
+				sequence - seq->last - 1, __ATOMIC_RELAXED);
+	seq->last = sequence;
+	seq->valid = 1;
+}
+
+void stats_account_sequence(struct stats_sequence *seq, uint32_t sequence)
+{
+	account_gap(seq, sequence);
+	__atomic_add_fetch(&frames_captured, 1, __ATOMIC_RELAXED);
+}
+
+void stats_mark_decimated(void)
+{
+	__atomic_add_fetch(&frames_decimated, 1, __ATOMIC_RELAXED);
+}
+
+void stats_mark_late(struct stats_sequence *seq, uint32_t sequence)
+{
+	account_gap(seq, sequence);
+	frames_late++;
+}
+
+void stats_frame_begin(const struct frame_info *info, size_t len)
+{
+	current = *info;
+	current_len = len;
+	converted_ns = 0;
+	skipped = 0;
+}
+
+void stats_mark_converted(void)
+{
+	converted_ns = stats_now();
+}
+
+void stats_mark_skipped(void)
+{
+	skipped = 1;
+}
+
+static void record(int stage, uint64_t from, uint64_t to)
+{
+	hist_record(&stages[stage], to > from ? to - from : 0);
+}
+
+static void update_rates(uint64_t now)
+{
+	uint64_t captured, elapsed = now - rate_start_ns;
+
+	if (elapsed < RATE_WINDOW_NS)
+		return;
+
+	captured = __atomic_load_n(&frames_captured, __ATOMIC_RELAXED);
+	if (rate_start_ns) {
+		capture_fps = (captured - rate_captured) * 1e9 / elapsed;
+		display_fps = (frames_displayed - rate_displayed) * 1e9
+			/ elapsed;
+		convert_bytes_per_s = (bytes_converted - rate_bytes) * 1e9
+			/ elapsed;
+	}
+	rate_start_ns = now;
+	rate_captured = captured;
+	rate_displayed = frames_displayed;
+	rate_bytes = bytes_converted;
+}
+
+void stats_frame_end(void)
+{
+	uint64_t submit_ns;
+
+	if (skipped) {
+		frames_skipped++;
+		return;
+	}
+
+	submit_ns = stats_now();
+	if (converted_ns)
+		bytes_converted += current_len;
+	else
+		converted_ns = submit_ns;
+
+	record(STAGE_CAPTURE, current.driver_ns, current.dequeue_ns);
+	record(STAGE_CONVERT, current.dequeue_ns, converted_ns);
+	record(STAGE_SUBMIT, converted_ns, submit_ns);
+	record(STAGE_TOTAL, current.driver_ns, submit_ns);
+	frames_displayed++;
+	if (!first_frame_ns && start_ns)
+		first_frame_ns = submit_ns - start_ns;
+
+	update_rates(submit_ns);
+}
+
+void stats_mark_presented(const struct frame_info *info, uint64_t present_ns,
+		unsigned int missed)
+{
+	if (present_ns)
+		record(STAGE_SCANOUT, info->driver_ns, present_ns);
+	if (present_ns && !first_presented_ns && start_ns)
+		first_presented_ns = present_ns - start_ns;
+	frames_presented++;
+	missed_vblanks += missed;
+}
+
+void stats_mark_discarded(void)
+{
+	frames_discarded++;
+}
+
+void stats_mark_replaced(void)
+{
+	frames_replaced++;
+}
+
+void stats_set_start(uint64_t ns)
+{
+	start_ns = ns;
+}
+
+uint64_t stats_first_frame_ns(void)
+{
+	return first_frame_ns;
+}
+
+/* scanout only means something with presentation feedback */
+static int n_reported_stages(void)
+{
+	return frames_presented || frames_discarded ? N_STAGES : STAGE_SCANOUT;
+}
+
+void stats_report(FILE *fp, unsigned long ring_dropped)
+{
+	const struct histogram *h;
+	int i;
+
+	fprintf(fp, "latency (ms)      p50      p99     p999      max\n");
+	for (i = 0; i < n_reported_stages(); i++) {
+		h = &stages[i];
+		fprintf(fp, "  %-8s %8.3f %8.3f %8.3f %8.3f\n",
+			stage_names[i],
+			hist_quantile(h, 0.5) / 1e6,
+			hist_quantile(h, 0.99) / 1e6,
+			hist_quantile(h, 0.999) / 1e6,
+			h->max / 1e6);
+	}
+	fprintf(fp, "frames: %llu captured, %llu displayed, %llu not shown\n",
+		(unsigned long long) __atomic_load_n(&frames_captured,
+			__ATOMIC_RELAXED),
+		(unsigned long long) frames_displayed,
+		(unsigned long long) frames_skipped);
+	fprintf(fp, "dropped: %llu by the driver, %lu in the ring",
+		(unsigned long long) __atomic_load_n(&driver_dropped,
+			__ATOMIC_RELAXED),
+		ring_dropped);
+	if (frames_decimated)
+		fprintf(fp, ", %llu decimated", (unsigned long long)
+			__atomic_load_n(&frames_decimated, __ATOMIC_RELAXED));
+	if (frames_late)
+		fprintf(fp, ", %llu late in playback",
+			(unsigned long long) frames_late);
+	fprintf(fp, "\n");
+	if (frames_presented || frames_discarded || frames_replaced)
+		fprintf(fp, "presented: %llu, %llu discarded, %llu replaced, "
+			"%llu missed vblanks\n",
+			(unsigned long long) frames_presented,
+			(unsigned long long) frames_discarded,
+			(unsigned long long) frames_replaced,
+			(unsigned long long) missed_vblanks);
+	if (first_frame_ns) {
+		fprintf(fp, "startup: first frame after %.1f ms",
+			first_frame_ns / 1e6);
+		if (first_presented_ns)
+			fprintf(fp, ", on screen after %.1f ms",
+				first_presented_ns / 1e6);
+		fprintf(fp, "\n");
+	}
+	fflush(fp);
+}
+
+void stats_report_json(FILE *fp, unsigned long ring_dropped)
+{
+	const struct histogram *h;
+	int i;
+
+	fprintf(fp, "\"stages\": {");
+	for (i = 0; i < n_reported_stages(); i++) {
+		h = &stages[i];
+		fprintf(fp, "%s\"%s\": {\"mean_ms\": %.3f, \"p50_ms\": %.3f, "
+			"\"p99_ms\": %.3f, \"max_ms\": %.3f}",
+			i ? ", " : "", stage_names[i],
+			hist_mean(h) / 1e6,
+			hist_quantile(h, 0.5) / 1e6,
+			hist_quantile(h, 0.99) / 1e6,
+			h->max / 1e6);
+	}
+	fprintf(fp, "}, \"captured\": %llu, \"displayed\": %llu, "
+		"\"not_shown\": %llu, \"driver_dropped\": %llu, "
+		"\"ring_dropped\": %lu",
+		(unsigned long long) __atomic_load_n(&frames_captured,
+			__ATOMIC_RELAXED),
+		(unsigned long long) frames_displayed,
+		(unsigned long long) frames_skipped,
+		(unsigned long long) __atomic_load_n(&driver_dropped,
+			__ATOMIC_RELAXED),
+		ring_dropped);
+	if (frames_decimated)
+		fprintf(fp, ", \"decimated\": %llu", (unsigned long long)
+			__atomic_load_n(&frames_decimated, __ATOMIC_RELAXED));
+	if (frames_late)
+		fprintf(fp, ", \"late\": %llu", (unsigned long long) frames_late);
+	if (frames_presented || frames_discarded || frames_replaced)
+		fprintf(fp, ", \"presented\": %llu, \"discarded\": %llu, "
+			"\"replaced\": %llu, \"missed_vblanks\": %llu",
+			(unsigned long long) frames_presented,
+			(unsigned long long) frames_discarded,
+			(unsigned long long) frames_replaced,
+			(unsigned long long) missed_vblanks);
+	if (first_frame_ns)
+		fprintf(fp, ", \"first_frame_ms\": %.3f",
+			first_frame_ns / 1e6);
+	if (first_presented_ns)
+		fprintf(fp, ", \"first_presented_ms\": %.3f",
+			first_presented_ns / 1e6);
+}
+
+static void prometheus_metric(FILE *fp, const char *name, const char *type,
+		const char *help, double value)
+{
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n",
+		name, help, name, type, name, value);
+}
+
+void stats_report_prometheus(FILE *fp, unsigned long ring_dropped)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const struct histogram *h;
+	unsigned int q;
+	int i;
+
+	/* a stalled display must not keep its last rates */
+	update_rates(stats_now());
+
+	prometheus_metric(fp, "svv_frames_captured_total", "counter",
+		"Frames dequeued from the devices",
+		__atomic_load_n(&frames_captured, __ATOMIC_RELAXED));
+	prometheus_metric(fp, "svv_frames_displayed_total", "counter",
+		"Frames handed to the display",
+		frames_displayed);
+	prometheus_metric(fp, "svv_frames_not_shown_total", "counter",
+		"Frames the display backend skipped",
+		frames_skipped);
+	prometheus_metric(fp, "svv_driver_dropped_total", "counter",
+		"Frames lost by the driver, from sequence gaps",
+		__atomic_load_n(&driver_dropped, __ATOMIC_RELAXED));
+	prometheus_metric(fp, "svv_ring_dropped_total", "counter",
+		"Frames dropped between the capture threads and the display",
+		ring_dropped);
+	prometheus_metric(fp, "svv_frames_decimated_total", "counter",
+		"Frames dropped after capture to meet --fps",
+		__atomic_load_n(&frames_decimated, __ATOMIC_RELAXED));
+	prometheus_metric(fp, "svv_frames_late_total", "counter",
+		"Recorded frames skipped to keep playback to the clock",
+		frames_late);
+	prometheus_metric(fp, "svv_convert_bytes_total", "counter",
+		"Frame bytes converted by the display backend",
+		bytes_converted);
+	prometheus_metric(fp, "svv_capture_fps", "gauge",
+		"Frames captured per second over the last second",
+		capture_fps);
+	prometheus_metric(fp, "svv_display_fps", "gauge",
+		"Frames displayed per second over the last second",
+		display_fps);
+	prometheus_metric(fp, "svv_convert_bytes_per_second", "gauge",
+		"Bytes converted per second over the last second",
+		convert_bytes_per_s);
+	if (first_frame_ns)
+		prometheus_metric(fp, "svv_first_frame_seconds", "gauge",
+			"Time from start to the first frame displayed",
+			first_frame_ns / 1e9);
+	if (first_presented_ns)
+		prometheus_metric(fp, "svv_first_presented_seconds", "gauge",
+			"Time from start to the first frame on screen",
+			first_presented_ns / 1e9);
+
+	fprintf(fp, "# HELP svv_stage_seconds Latency of each pipeline stage\n"
+		"# TYPE svv_stage_seconds summary\n");
+	for (i = 0; i < n_reported_stages(); i++) {
+		h = &stages[i];
+		for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+			fprintf(fp, "svv_stage_seconds{stage=\"%s\","
+				"quantile=\"%g\"} %.9f\n", stage_names[i],
+				quantiles[q],
+				hist_quantile(h, quantiles[q]) / 1e9);
+		fprintf(fp, "svv_stage_seconds_sum{stage=\"%s\"} %.9f\n",
+			stage_names[i], h->sum / 1e9);
+		fprintf(fp, "svv_stage_seconds_count{stage=\"%s\"} %llu\n",
+			stage_names[i], (unsigned long long) h->total);
+	}
+
+	if (frames_presented || frames_discarded) {
+		prometheus_metric(fp, "svv_frames_presented_total", "counter",
+			"Frames the compositor reported on screen",
+			frames_presented);
+		prometheus_metric(fp, "svv_missed_vblanks_total", "counter",
+			"Refresh periods frames waited past the first",
+			missed_vblanks);
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame.h"
+
+/*
+ * Capture to display latency and frame loss. The capture side reports
+ * sequence numbers, the display side brackets each frame with
+ * stats_frame_begin()/stats_frame_end(); backends may mark when their
+ * conversion finished or that they did not show the frame at all.
+ */
+
+uint64_t stats_now(void);
+
+/* Sequence numbers seen on one stream */
+struct stats_sequence {
+	int             valid;
+	uint32_t        last;
+};
+
+/* Capture side, any thread, a stats_sequence per stream. Sequence gaps
+count as driver drops */
+void stats_account_sequence(struct stats_sequence *seq, uint32_t sequence);
+
+/* Capture side, any thread. A frame dropped to meet --fps */
+void stats_mark_decimated(void);
+
+/* Playback, main loop only. A recorded frame skipped to keep to the clock:
+counted as late rather than as a driver drop. Gaps in the recorded
+sequence before it still are driver drops */
+void stats_mark_late(struct stats_sequence *seq, uint32_t sequence);
+
+/* Display side, main loop only. len is the size of the frame handed to
+the backend, counted as converted if it marks the conversion */
+void stats_frame_begin(const struct frame_info *info, size_t len);
+void stats_mark_converted(void);
+void stats_mark_skipped(void);
+void stats_frame_end(void);
+
+/* Display side, for backends that learn when frames reach the screen.
+present_ns is CLOCK_MONOTONIC or 0 if the clock is another one. A frame
+replaced was converted but a newer one took its place before the
+compositor got it */
+void stats_mark_presented(const struct frame_info *info, uint64_t present_ns,
+		unsigned int missed_vblanks);
+void stats_mark_discarded(void);
+void stats_mark_replaced(void);
+
+/* Time to first frame is measured from start_ns, usually main() */
+void stats_set_start(uint64_t start_ns);
+
+/* Since start, 0 until the first frame was displayed */
+uint64_t stats_first_frame_ns(void);
+
+void stats_report(FILE *fp, unsigned long ring_dropped);
+
+/* The same figures as JSON members, without the enclosing braces */
+void stats_report_json(FILE *fp, unsigned long ring_dropped);
+
+/* Prometheus text format, with the rates of the last second */
+void stats_report_prometheus(FILE *fp, unsigned long ring_dropped);
+
+#endif // STATS_H
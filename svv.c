@@ -18,6 +18,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <malloc.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
@@ -25,6 +28,23 @@
 #include <libv4l2.h>
 #include <libv4lconvert.h>
 #include <glib.h>
+#include <glib-unix.h>
+
+#include "ring.h"
+#include "source.h"
+#include "convert.h"
+#include "stats.h"
+#include "bench.h"
+#include "recorder.h"
+#include "player.h"
+#include "lowlat.h"
+#include "snapshot.h"
+#include "publish.h"
+#include "probe.h"
+#include "motion.h"
+#include "metrics.h"
+#include "trace.h"
+#include "startup.h"
 
 #ifdef HAVE_WAYLAND
 #include "wayland-backend.h"
@@ -35,6 +55,12 @@
 
 typedef struct __GuiGtk {
 	GtkWidget   *drawing_area;
+#if GTK_CHECK_VERSION(3, 0, 0)
+	cairo_surface_t *surface;	/* frames are converted straight into it */
+	int         dirty;		/* a frame arrived since the last draw */
+#else
+	guchar      *rgbx;		/* converted frame for non RGB24 formats */
+#endif
 } GuiGtk;
 
 static GuiGtk g_ui;
@@ -50,8 +76,22 @@ typedef struct __GuiCaca {
 	caca_dither_t   *im;
 	int             ww;
 	int             wh;
+	unsigned char   *xrgb;		/* converted frame for non RGB24 formats */
+
+	/* box filtered to a few pixels per cell before dithering */
+	unsigned char   *small;
+	int             fx;
+	int             fy;
+
+	/* frames are skipped until the terminal had time to take the last
+	refresh, caca_refresh_display() blocks on slow (ssh) terminals */
+	uint64_t        render_ns;	/* moving average */
+	uint64_t        next_ns;
 } GuiCaca;
 
+#define CONSOLE_CELL_PIXELS 2	/* per cell and axis kept by the box filter */
+#define CONSOLE_DUTY 50		/* percent of the time spent rendering */
+
 static GuiCaca c_ui;
 #endif
 
@@ -62,11 +102,18 @@ typedef struct __GuiNone {
 } GuiNone;
 static GuiNone n_ui;
 
-typedef void (*GuiUpdateFunction)(unsigned char *pixels, int len);
-typedef void (*GuiInitFunction)(int argc, char *argv[], int w, int h, int bpp);
+typedef void (*GuiUpdateFunction)(unsigned char *pixels, int len,
+		const struct frame_info *info);
+typedef void (*GuiInitFunction)(int argc, char *argv[],
+		const struct v4l2_pix_format *pix);
+/* The part of the init that does not need the format, it runs while the
+devices are being set up */
+typedef void (*GuiConnectFunction)(int *argc, char ***argv);
 
 static GuiUpdateFunction    gui_update_function;
 static GuiInitFunction      gui_init_function;
+static GuiConnectFunction   gui_connect_function;
+static int                  use_wayland;
 
 static GMainLoop            *loop;
 
@@ -80,40 +127,222 @@ enum v4l2_memory {
 #define IO_METHOD_READ 42
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define DEFAULT_NUM_FRAMES 100
+#define RING_SLOTS 4
+#define DEFAULT_BUFFERS 4
+#define ADAPT_MIN_BUFFERS 2
+#define ADAPT_MAX_BUFFERS 16
+#define ADAPT_WINDOW 120	/* frames between queue depth decisions */
+#define BENCH_MAX_CASES 12	/* 3 I/O methods x 4 UIs */
+#define DEFAULT_RECORD_BUFFER 256	/* MiB, ~1s of 1080p60 YUYV */
+#define MAX_DEVICES 8
+#define PUBLISH_SLOTS 8	/* a reader may lag 7 frames */
 
 struct buffer {
 	void            *start;
 	size_t          length;
 };
 
-static char         *dev_name = "/dev/video0";
+/* Negotiates the format, size and frame rate from what the device
+produces without libv4l. --reprobe ignores the cached enumeration */
+#define PIXFMT_NATIVE 0
+#define LIBV4L_DECODE_COST 64	/* MJPEG and the like, per pixel */
+static int          reprobe;
+
 static int          io = V4L2_MEMORY_MMAP;
-static int          fd = -1;
-struct buffer       *buffers;
-static int          n_buffers;
+static unsigned int pixelformat = PIXFMT_NATIVE;
+static unsigned int req_buffers = DEFAULT_BUFFERS;
+
+/* Format of the frames handed to the UI: the device's, or the tiles
+composed from every device */
 static struct       v4l2_format fmt;
 
-void gui_none_init(int argc, char *argv[], int w, int h, int bpp)
+/* USERPTR buffers live in the Wayland shm pool, frames are displayed
+without a copy and requeued when the compositor releases them */
+static int          zero_copy;
+
+/* Adaptive queue depth: grow when the driver drops frames (sequence
+gaps), shrink while buffers never back up, stop at the smallest depth
+that runs a whole window without drops */
+typedef struct __AdaptState {
+	int             enabled;
+	long            frames;
+	long            drops;
+	unsigned int    max_queued;
+	unsigned int    fail_depth;	/* largest depth seen dropping */
+	int             settled;
+	int             have_sequence;
+	__u32           last_sequence;
+} AdaptState;
+static int          adapt_enabled;
+
+/* Threaded capture: the capture thread owns the device and hands copies of
+each frame to the main loop through the ring */
+static int          threaded;
+static enum ring_policy drop_policy = RING_DROP_OLDEST;
+
+/* Low latency: the capture threads lock memory, can be pinned and run
+SCHED_FIFO, and either sleep in poll() or spin on DQBUF */
+static int          low_latency;
+static int          busy_poll;
+static int          rt_cpu = -1;
+static int          rt_priority;
+
+/* Everything about one capture device. With several devices each runs on
+its own capture thread and the main loop composes them into tiles */
+struct device {
+	const char      *name;
+	const struct capture_source *source;
+	int             fd;
+	struct buffer   *buffers;
+	int             n_buffers;
+	unsigned int    req_buffers;
+	struct          v4l2_format fmt;
+	AdaptState      adapt;
+	struct stats_sequence seq;
+	__u32           read_sequence;	/* read() I/O has no buffer sequence */
+
+	/* threaded */
+	struct ring     *ring;
+	unsigned char   *ring_frame;
+	pthread_t       capture_tid;
+	int             capture_running;
+	struct lowlat_jitter *jitter;	/* low latency only */
+	struct motion   *motion;	/* --motion only */
+	int             libv4l_convert;	/* DQBUF converts, for --trace */
+
+	/* --fps beyond what the driver slows down to */
+	uint64_t        decimate_ns;	/* output frame period, 0 when off */
+	uint64_t        decimate_next_ns;
+	uint64_t        decimate_last_ns;
+
+	/* position in the tiled frame */
+	int             tile_x;
+	int             tile_y;
+};
+
+static struct device devices[MAX_DEVICES];
+static int          n_devices;
+
+/* Tiled display, fmt is XBGR32 then */
+static unsigned char *tiles;
+static struct frame_info tiles_info;
+static guint        tiles_present_id;
+
+/* --record, fed by read_frame() before the display sees the frame */
+static const char   *record_path;
+static size_t       record_buffer = DEFAULT_RECORD_BUFFER;
+static struct recorder *recorder;
+
+/* --metrics socket path */
+static const char   *metrics_path;
+
+/* --fps, asked of the driver with VIDIOC_S_PARM. When it stays faster
+the frames are decimated after capture, before anything else sees them */
+static double       frame_rate;
+#define DECIMATE_TOLERANCE 1.05	/* driver rate over --fps left alone */
+
+/* --motion, frames that did not change are dropped after capture */
+static unsigned int motion_threshold;
+
+/* --snapshot/--burst, fed like the recorder but before the motion check.
+SIGUSR2 or 's' in the gtk window saves the next burst frames */
+static int          snapshot_enabled;
+static enum snapshot_format snapshot_format = SNAPSHOT_PPM;
+static unsigned int snapshot_burst = 1;
+static int          snapshot_at_start;
+static struct snapshot *snapshot;
+
+/* --publish, every captured frame also goes to a shared memory ring */
+static const char   *publish_name;
+static struct publisher *publisher;
+
+/* --play, a recording takes the place of the device */
+static const char   *play_path;
+static double       play_speed = 1.0;
+static unsigned long play_start;
+static struct player *player;
+
+/* --bench, every I/O method against every UI compiled in */
+static int          bench;
+static const char   *bench_uis[] = {
+	"none",
+#ifdef HAVE_GTK
+	"gtk",
+#endif
+#ifdef HAVE_CACA
+	"console",
+#endif
+#ifdef HAVE_WAYLAND
+	"wayland",
+#endif
+};
+
+void gui_none_connect(int *argc, char ***argv)
+{
+
+}
+
+void gui_none_init(int argc, char *argv[], const struct v4l2_pix_format *pix)
 {
 
 }
 
-void gui_none_update(unsigned char *p, int len)
+void gui_none_update(unsigned char *p, int len, const struct frame_info *info)
 {
 
 }
 
+#ifdef HAVE_WAYLAND
+static void gui_wayland_connect(int *argc, char ***argv)
+{
+	wayland_backend_connect();
+}
+#endif
+
 #ifdef HAVE_GTK
 static void gui_gtk_quit(void)
 {
 	g_main_loop_quit (loop);
 }
 
-void gui_gtk_init(int argc, char *argv[], int w, int h, int bpp)
+/* 's' takes a snapshot when they are enabled, any other key quits */
+static gboolean gui_gtk_key(GtkWidget *widget, GdkEventKey *event,
+		gpointer data)
 {
-	GtkWidget *window;
+	if (snapshot && event->keyval == 's')
+		snapshot_trigger(snapshot);
+	else
+		gui_gtk_quit();
+	return TRUE;
+}
+
+#if GTK_CHECK_VERSION(3, 0, 0)
+static gboolean gui_gtk_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+	cairo_set_source_surface(cr, g_ui.surface, 0, 0);
+	cairo_paint(cr);
+	return FALSE;
+}
 
-	gtk_init(&argc, &argv);
+static gboolean gui_gtk_tick(GtkWidget *widget, GdkFrameClock *clock,
+		gpointer data)
+{
+	if (g_ui.dirty) {
+		g_ui.dirty = 0;
+		gtk_widget_queue_draw(widget);
+	}
+	return G_SOURCE_CONTINUE;
+}
+#endif
+
+void gui_gtk_connect(int *argc, char ***argv)
+{
+	gtk_init(argc, argv);
+}
+
+void gui_gtk_init(int argc, char *argv[], const struct v4l2_pix_format *pix)
+{
+	GtkWidget *window;
 
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW(window), PACKAGE_NAME);
@@ -123,14 +352,34 @@ void gui_gtk_init(int argc, char *argv[], int w, int h, int bpp)
 	g_signal_connect(G_OBJECT(window), "destroy",
 			   G_CALLBACK(gui_gtk_quit), NULL);
 	g_signal_connect(G_OBJECT(window), "key_press_event",
-			   G_CALLBACK(gui_gtk_quit), NULL);
+			   G_CALLBACK(gui_gtk_key), NULL);
 
 	gtk_container_set_border_width(GTK_CONTAINER(window), 2);
 
 	g_ui.drawing_area = gtk_drawing_area_new();
+#if GTK_CHECK_VERSION(3, 0, 0)
+	gtk_widget_set_size_request(g_ui.drawing_area,
+			pix->width, pix->height);
+
+	g_ui.surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+			pix->width, pix->height);
+	if (cairo_surface_status(g_ui.surface) != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "Cannot create the cairo surface\n");
+		exit(EXIT_FAILURE);
+	}
+
+	g_signal_connect(G_OBJECT(g_ui.drawing_area), "draw",
+			   G_CALLBACK(gui_gtk_draw), NULL);
+	gtk_widget_add_tick_callback(g_ui.drawing_area, gui_gtk_tick,
+			NULL, NULL);
+#else
 	gtk_drawing_area_size(
 			GTK_DRAWING_AREA(g_ui.drawing_area),
-			fmt.fmt.pix.width, fmt.fmt.pix.height);
+			pix->width, pix->height);
+
+	if (pix->pixelformat != V4L2_PIX_FMT_RGB24)
+		g_ui.rgbx = malloc(pix->width * pix->height * 4);
+#endif
 
 	gtk_container_add(GTK_CONTAINER(window), g_ui.drawing_area);
 
@@ -138,8 +387,57 @@ void gui_gtk_init(int argc, char *argv[], int w, int h, int bpp)
 
 }
 
-void gui_gtk_update(unsigned char *p, int len)
+#if GTK_CHECK_VERSION(3, 0, 0)
+/* Frames are converted into the cairo surface as they arrive, the frame
+clock decides when to paint the latest one */
+void gui_gtk_update(unsigned char *p, int len, const struct frame_info *info)
+{
+	if ((size_t) len < conv_frame_size(fmt.fmt.pix.pixelformat,
+			fmt.fmt.pix.bytesperline, fmt.fmt.pix.height)) {
+		stats_mark_skipped();
+		return;
+	}
+
+	/* CAIRO_FORMAT_RGB24 is native endian XRGB, B,G,R,X bytes here */
+	cairo_surface_flush(g_ui.surface);
+	conv_frame_to_32(fmt.fmt.pix.pixelformat,
+			p, fmt.fmt.pix.bytesperline,
+			cairo_image_surface_get_data(g_ui.surface),
+			cairo_image_surface_get_stride(g_ui.surface),
+			fmt.fmt.pix.width, fmt.fmt.pix.height,
+			CONV_ORDER_BGRX);
+	cairo_surface_mark_dirty(g_ui.surface);
+	stats_mark_converted();
+
+	g_ui.dirty = 1;
+}
+#else
+void gui_gtk_update(unsigned char *p, int len, const struct frame_info *info)
 {
+	if ((size_t) len < conv_frame_size(fmt.fmt.pix.pixelformat,
+			fmt.fmt.pix.bytesperline, fmt.fmt.pix.height)) {
+		stats_mark_skipped();
+		return;
+	}
+
+	if (g_ui.rgbx) {
+		/* YUV goes straight to padded RGB, gdk skips its own repack */
+		conv_frame_to_32(fmt.fmt.pix.pixelformat,
+				p, fmt.fmt.pix.bytesperline,
+				g_ui.rgbx, fmt.fmt.pix.width * 4,
+				fmt.fmt.pix.width, fmt.fmt.pix.height,
+				CONV_ORDER_RGBX);
+		gdk_draw_rgb_32_image(
+				   gtk_widget_get_window(g_ui.drawing_area),
+				   gtk_widget_get_style(g_ui.drawing_area)->white_gc,
+				   0, 0,
+				   fmt.fmt.pix.width, fmt.fmt.pix.height,
+				   GDK_RGB_DITHER_NORMAL,
+				   g_ui.rgbx,
+				   fmt.fmt.pix.width * 4);
+		return;
+	}
+
 	gdk_draw_rgb_image(
 			   gtk_widget_get_window(g_ui.drawing_area),
 			   gtk_widget_get_style(g_ui.drawing_area)->white_gc,
@@ -150,10 +448,39 @@ void gui_gtk_update(unsigned char *p, int len)
 			   fmt.fmt.pix.width * 3);
 }
 #endif
+#endif
 
 #ifdef HAVE_CACA
-void gui_console_update(unsigned char *p, int len)
+void gui_console_update(unsigned char *p, int len,
+		const struct frame_info *info)
 {
+	uint64_t start, cost;
+
+	start = stats_now();
+	if (start < c_ui.next_ns || (size_t) len < conv_frame_size(
+			fmt.fmt.pix.pixelformat, fmt.fmt.pix.bytesperline,
+			fmt.fmt.pix.height)) {
+		stats_mark_skipped();
+		return;
+	}
+
+	if (c_ui.xrgb) {
+		conv_frame_to_32(fmt.fmt.pix.pixelformat,
+				p, fmt.fmt.pix.bytesperline,
+				c_ui.xrgb, fmt.fmt.pix.width * 4,
+				fmt.fmt.pix.width, fmt.fmt.pix.height,
+				CONV_ORDER_BGRX);
+		p = c_ui.xrgb;
+	}
+	if (c_ui.small) {
+		conv_downscale_32(p, fmt.fmt.pix.width * 4,
+				c_ui.small, fmt.fmt.pix.width / c_ui.fx * 4,
+				fmt.fmt.pix.width, fmt.fmt.pix.height,
+				c_ui.fx, c_ui.fy);
+		p = c_ui.small;
+	}
+	stats_mark_converted();
+
 	caca_dither_bitmap(
 		c_ui.cv,
 		0, 0,
@@ -161,9 +488,15 @@ void gui_console_update(unsigned char *p, int len)
 		c_ui.im,
 		p);
 	caca_refresh_display(c_ui.dp);
+
+	cost = stats_now() - start;
+	c_ui.render_ns = c_ui.render_ns ?
+		(c_ui.render_ns * 7 + cost) / 8 : cost;
+	c_ui.next_ns = start
+		+ c_ui.render_ns * 100 / CONSOLE_DUTY;
 }
 
-void gui_console_init(int argc, char *argv[], int w, int h, int bpp)
+void gui_console_connect(int *argc, char ***argv)
 {
 		c_ui.dp = caca_create_display(NULL);
 		c_ui.cv = caca_get_canvas(c_ui.dp);
@@ -171,11 +504,48 @@ void gui_console_init(int argc, char *argv[], int w, int h, int bpp)
 		c_ui.wh = caca_get_canvas_height(c_ui.cv);
 
 		caca_set_display_title(c_ui.dp, PACKAGE_NAME);
-		c_ui.im = caca_create_dither(
-					bpp,
-					w, h,
-					3 * w /*stride*/,
-					0xff0000, 0x00ff00, 0x0000ff, 0);
+}
+
+void gui_console_init(int argc, char *argv[], const struct v4l2_pix_format *pix)
+{
+		int w = pix->width;
+		int h = pix->height;
+
+		c_ui.fx = w / (c_ui.ww * CONSOLE_CELL_PIXELS);
+		c_ui.fy = h / (c_ui.wh * CONSOLE_CELL_PIXELS);
+		if (c_ui.fx < 1)
+			c_ui.fx = 1;
+		if (c_ui.fy < 1)
+			c_ui.fy = 1;
+		if (c_ui.fy > 257)
+			c_ui.fy = 257;
+
+		if (c_ui.fx > 1 || c_ui.fy > 1) {
+			/* the filter works on 32 bit pixels */
+			c_ui.xrgb = malloc(w * h * 4);
+			w /= c_ui.fx;
+			h /= c_ui.fy;
+			c_ui.small = malloc(w * h * 4);
+			c_ui.im = caca_create_dither(
+						32,
+						w, h,
+						4 * w /*stride*/,
+						0xff0000, 0x00ff00, 0x0000ff, 0);
+		} else if (pix->pixelformat == V4L2_PIX_FMT_RGB24) {
+			c_ui.im = caca_create_dither(
+						24,
+						w, h,
+						3 * w /*stride*/,
+						0xff0000, 0x00ff00, 0x0000ff, 0);
+		} else {
+			/* XRGB8888 read as native endian 32 bit words */
+			c_ui.xrgb = malloc(w * h * 4);
+			c_ui.im = caca_create_dither(
+						32,
+						w, h,
+						4 * w /*stride*/,
+						0xff0000, 0x00ff00, 0x0000ff, 0);
+		}
 }
 #endif
 
@@ -185,8 +555,33 @@ static void errno_exit(const char *s)
 	exit(EXIT_FAILURE);
 }
 
-static void process_image(unsigned char *p, int len)
+/* Device setup prints through these and returns its errors rather than
+exiting. While the setup thread runs they collect its output, which main
+prints after joining it, not mixed into what the display connection says */
+static FILE *setup_out;
+static FILE *setup_err;
+
+static int errno_fail(const char *s)
+{
+	fprintf(setup_err, "%s error %d, %s\n", s, errno, strerror(errno));
+	return -1;
+}
+
+/* -n counts captured frames, those --motion skips on the capture thread
+too, g_main_loop_quit() is fine from any thread */
+static void count_frame(void)
+{
+	if (n_ui.num_frames > 0)
+		if (__atomic_add_fetch(&n_ui.frame, 1, __ATOMIC_RELAXED)
+				>= n_ui.num_frames)
+			g_main_loop_quit (loop);
+}
+
+static void process_image(unsigned char *p, int len,
+		const struct frame_info *info)
 {
+	uint64_t start = trace_begin(), t;
+
 	if (n_ui.grab) {
 		FILE *f;
 		f = fopen("image.dat", "w");
@@ -195,21 +590,179 @@ static void process_image(unsigned char *p, int len)
 		printf("image dumped to 'image.dat'\n");
 	}
 
-	gui_update_function(p, len);
+	stats_frame_begin(info, len);
+	t = trace_begin();
+	gui_update_function(p, len, info);
+	trace_end("update", info->sequence, t);
+	stats_frame_end();
+	startup_first_frame();
 
-	if (n_ui.num_frames > 0)
-		if (++n_ui.frame >= n_ui.num_frames)
-			g_main_loop_quit (loop);
+	count_frame();
+	trace_end("process_image", info->sequence, start);
+}
+
+static void resize_queue(struct device *dev, unsigned int count);
+
+static unsigned int count_queued_frames(struct device *dev, int memory)
+{
+	struct v4l2_buffer buf;
+	unsigned int i, queued = 0;
+
+	for (i = 0; i < dev->n_buffers; ++i) {
+		CLEAR(buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = memory;
+		buf.index = i;
+		if (dev->source->ioctl(dev->fd, VIDIOC_QUERYBUF, &buf) == 0
+				&& (buf.flags & V4L2_BUF_FLAG_DONE))
+			queued++;
+	}
+	return queued;
+}
+
+static void adapt_account(struct device *dev, const struct v4l2_buffer *buf)
+{
+	AdaptState *adapt = &dev->adapt;
+	unsigned int queued;
+
+	if (adapt->have_sequence && buf->sequence > adapt->last_sequence + 1)
+		adapt->drops += buf->sequence - adapt->last_sequence - 1;
+	adapt->last_sequence = buf->sequence;
+	adapt->have_sequence = 1;
+
+	/* filled buffers still waiting behind the one just dequeued */
+	queued = count_queued_frames(dev, buf->memory);
+	if (queued > adapt->max_queued)
+		adapt->max_queued = queued;
+
+	adapt->frames++;
+}
+
+/* Runs after the buffer went back to the driver, may restart streaming */
+static void adapt_step(struct device *dev)
+{
+	AdaptState *adapt = &dev->adapt;
+	unsigned int depth = dev->n_buffers;
+	unsigned int next = depth;
+
+	if (adapt->frames < ADAPT_WINDOW)
+		return;
+
+	if (adapt->drops > 0) {
+		if (depth > adapt->fail_depth)
+			adapt->fail_depth = depth;
+		if (depth < ADAPT_MAX_BUFFERS) {
+			next = depth * 2 > ADAPT_MAX_BUFFERS ?
+				ADAPT_MAX_BUFFERS : depth * 2;
+			printf("%s buffers: %ld frames dropped with %u, "
+				"trying %u\n", dev->name, adapt->drops, depth,
+				next);
+		}
+	} else if (depth > ADAPT_MIN_BUFFERS && depth - 1 > adapt->fail_depth
+			&& adapt->max_queued + 1 < depth) {
+		next = depth - 1;
+	} else if (!adapt->settled) {
+		printf("%s buffers: settled on %u (max %u queued)\n",
+			dev->name, depth, adapt->max_queued);
+		adapt->settled = 1;
+	}
+
+	adapt->frames = 0;
+	adapt->drops = 0;
+	adapt->max_queued = 0;
+
+	if (next != depth) {
+		adapt->settled = 0;
+		resize_queue(dev, next);
+	}
+}
+
+/* Fills info for a dequeued buffer. Only monotonic driver timestamps
+are comparable with our clock, others count from the dequeue */
+static void frame_info_from_buf(struct device *dev, struct frame_info *info,
+		const struct v4l2_buffer *buf)
+{
+	info->sequence = buf->sequence;
+	info->dequeue_ns = stats_now();
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+			== V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+			&& (buf->timestamp.tv_sec || buf->timestamp.tv_usec))
+		info->driver_ns = buf->timestamp.tv_sec * 1000000000ULL
+			+ buf->timestamp.tv_usec * 1000ULL;
+	else
+		info->driver_ns = info->dequeue_ns;
+	stats_account_sequence(&dev->seq, info->sequence);
 }
 
-static int read_frame(void)
+/* Software --fps, keeps the frames nearest a period apart. Returns 1 if
+the frame is to be dropped */
+static int decimate(struct device *dev, const struct frame_info *info)
+{
+	uint64_t t = info->driver_ns, slack = 0;
+
+	/* half a source frame early is still on time */
+	if (dev->decimate_last_ns && t > dev->decimate_last_ns)
+		slack = (t - dev->decimate_last_ns) / 2;
+	dev->decimate_last_ns = t;
+
+	if (dev->decimate_next_ns && t + slack < dev->decimate_next_ns)
+		return 1;
+
+	/* keep the cadence, unless the stream stalled for a whole period */
+	if (dev->decimate_next_ns
+			&& t < dev->decimate_next_ns + dev->decimate_ns)
+		dev->decimate_next_ns += dev->decimate_ns;
+	else
+		dev->decimate_next_ns = t + dev->decimate_ns;
+	return 0;
+}
+
+/* Called from read_frame(), on the capture thread when threaded. Returns
+0 if the frame was decimated or did not change, and went nowhere */
+static int deliver_frame(struct device *dev, unsigned char *p, int len,
+		const struct frame_info *info)
+{
+	if (dev->jitter)
+		lowlat_account(dev->jitter, info);
+
+	if (dev->decimate_ns && decimate(dev, info)) {
+		stats_mark_decimated();
+		return 0;
+	}
+
+	/* a snapshot asked for is taken even if nothing moved */
+	if (snapshot)
+		snapshot_push(snapshot, p, len, info);
+	if (publisher)
+		publisher_push(publisher, p, len, info);
+
+	if (dev->motion && !motion_check(dev->motion, p, len, info)) {
+		count_frame();
+		return 0;
+	}
+
+	if (recorder)
+		recorder_push(recorder, p, len, info);
+
+	if (dev->ring)
+		ring_push(dev->ring, p, len, info);
+	else
+		process_image(p, len, info);
+	return 1;
+}
+
+static int read_frame(struct device *dev)
 {
 	struct v4l2_buffer buf;
+	struct frame_info info;
+	uint64_t t;
 	int i;
 
+	t = trace_begin();
 	switch (io) {
 	case IO_METHOD_READ:
-		i = v4l2_read(fd, buffers[0].start, buffers[0].length);
+		i = dev->source->read(dev->fd, dev->buffers[0].start,
+				dev->buffers[0].length);
 		if (i < 0) {
 			switch (errno) {
 			case EAGAIN:
@@ -221,7 +774,13 @@ static int read_frame(void)
 				errno_exit("read");
 			}
 		}
-		process_image(buffers[0].start, i);
+		info.sequence = dev->read_sequence++;
+		info.dequeue_ns = stats_now();
+		info.driver_ns = info.dequeue_ns;
+		stats_account_sequence(&dev->seq, info.sequence);
+		trace_end(dev->libv4l_convert ? "read+libv4l" : "read",
+				info.sequence, t);
+		deliver_frame(dev, dev->buffers[0].start, i, &info);
 		break;
 
 	case V4L2_MEMORY_MMAP:
@@ -229,7 +788,7 @@ static int read_frame(void)
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_MMAP;
 
-		if (v4l2_ioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+		if (dev->source->ioctl(dev->fd, VIDIOC_DQBUF, &buf) < 0) {
 			switch (errno) {
 			case EAGAIN:
 				return 0;
@@ -240,12 +799,24 @@ static int read_frame(void)
 				errno_exit("VIDIOC_DQBUF");
 			}
 		}
-		assert(buf.index < n_buffers);
+		assert(buf.index < dev->n_buffers);
+
+		frame_info_from_buf(dev, &info, &buf);
+		trace_end(dev->libv4l_convert ? "DQBUF+libv4l" : "DQBUF",
+				info.sequence, t);
+		if (dev->adapt.enabled)
+			adapt_account(dev, &buf);
 
-		process_image(buffers[buf.index].start, buf.bytesused);
+		deliver_frame(dev, dev->buffers[buf.index].start, buf.bytesused,
+				&info);
 
-		if (v4l2_ioctl(fd, VIDIOC_QBUF, &buf) < 0)
+		t = trace_begin();
+		if (dev->source->ioctl(dev->fd, VIDIOC_QBUF, &buf) < 0)
 			errno_exit("VIDIOC_QBUF");
+		trace_end("QBUF", info.sequence, t);
+
+		if (dev->adapt.enabled)
+			adapt_step(dev);
 		break;
 	case V4L2_MEMORY_USERPTR:
 		CLEAR(buf);
@@ -253,7 +824,7 @@ static int read_frame(void)
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_USERPTR;
 
-		if (v4l2_ioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+		if (dev->source->ioctl(dev->fd, VIDIOC_DQBUF, &buf) < 0) {
 			switch (errno) {
 			case EAGAIN:
 				return 0;
@@ -265,59 +836,271 @@ static int read_frame(void)
 			}
 		}
 
-		for (i = 0; i < n_buffers; ++i)
-			if (buf.m.userptr == (unsigned long) buffers[i].start
-				&& buf.length == buffers[i].length)
+		for (i = 0; i < dev->n_buffers; ++i)
+			if (buf.m.userptr
+					== (unsigned long) dev->buffers[i].start
+				&& buf.length == dev->buffers[i].length)
 				break;
-		assert(i < n_buffers);
+		assert(i < dev->n_buffers);
 
-		process_image((unsigned char *) buf.m.userptr,
-				buf.bytesused);
+		frame_info_from_buf(dev, &info, &buf);
+		trace_end(dev->libv4l_convert ? "DQBUF+libv4l" : "DQBUF",
+				info.sequence, t);
+		if (dev->adapt.enabled)
+			adapt_account(dev, &buf);
 
-		if (v4l2_ioctl(fd, VIDIOC_QBUF, &buf) < 0)
+#ifdef HAVE_WAYLAND
+		/* requeued by requeue_userptr() once the compositor is done,
+		unchanged frames go straight back */
+		if (deliver_frame(dev, (unsigned char *) buf.m.userptr,
+				buf.bytesused, &info)
+				&& zero_copy && wayland_backend_submit(i, &info))
+			break;
+#else
+		deliver_frame(dev, (unsigned char *) buf.m.userptr,
+				buf.bytesused, &info);
+#endif
+
+		t = trace_begin();
+		if (dev->source->ioctl(dev->fd, VIDIOC_QBUF, &buf) < 0)
 			errno_exit("VIDIOC_QBUF");
+		trace_end("QBUF", info.sequence, t);
+
+		if (dev->adapt.enabled)
+			adapt_step(dev);
 		break;
 	}
 	return 1;
 }
 
-static void frame_ready(GIOChannel *source, GIOCondition condition, gpointer data)
+#ifdef HAVE_WAYLAND
+/* zero copy runs with a single device */
+static void requeue_userptr(int index)
+{
+	struct device *dev = &devices[0];
+	struct v4l2_buffer buf;
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_USERPTR;
+	buf.index = index;
+	buf.m.userptr = (unsigned long) dev->buffers[index].start;
+	buf.length = dev->buffers[index].length;
+
+	if (dev->source->ioctl(dev->fd, VIDIOC_QBUF, &buf) < 0)
+		errno_exit("VIDIOC_QBUF");
+}
+#endif
+
+static gboolean frame_ready(GIOChannel *source, GIOCondition condition, gpointer data)
 {
 	if (condition & G_IO_IN)
-		read_frame();
+		read_frame(data);
+	return TRUE;
 }
 
-static int get_frame()
+static gboolean present_tiles(gpointer data)
 {
-#if 0
-	fd_set fds;
-	struct timeval tv;
-	int r;
+	tiles_present_id = 0;
+	process_image(tiles, fmt.fmt.pix.sizeimage, &tiles_info);
+	return FALSE;
+}
+
+/* Converts the frame into its tile, the tiles are shown once the main
+loop has no more frames to take in */
+static void tile_frame(struct device *dev, unsigned char *p, int len,
+		const struct frame_info *info)
+{
+	const struct v4l2_pix_format *pix = &dev->fmt.fmt.pix;
+
+	if ((size_t) len < conv_frame_size(pix->pixelformat,
+			pix->bytesperline, pix->height))
+		return;
+
+	conv_frame_to_32(pix->pixelformat, p, pix->bytesperline,
+			tiles + dev->tile_y * fmt.fmt.pix.bytesperline
+				+ dev->tile_x * 4,
+			fmt.fmt.pix.bytesperline,
+			pix->width, pix->height, CONV_ORDER_BGRX);
+
+	tiles_info = *info;
+	if (!tiles_present_id)
+		tiles_present_id = g_idle_add(present_tiles, NULL);
+}
+
+static void show_frame(struct device *dev, unsigned char *p, int len,
+		const struct frame_info *info)
+{
+	if (tiles)
+		tile_frame(dev, p, len, info);
+	else
+		process_image(p, len, info);
+}
+
+static gboolean ring_ready(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	struct device *dev = data;
+	struct ring_slot *slot;
+	struct frame_info info;
+	size_t len;
+
+	ring_ack(dev->ring);
+
+	if (drop_policy == RING_BLOCK) {
+		/* the producer never overwrites a queued slot, display in place */
+		while ((slot = ring_peek(dev->ring)) != NULL) {
+			show_frame(dev, slot->data, slot->len, &slot->info);
+			ring_release(dev->ring);
+		}
+	} else {
+		while ((len = ring_pop(dev->ring, dev->ring_frame, &info)) > 0)
+			show_frame(dev, dev->ring_frame, len, &info);
+	}
+	return TRUE;
+}
+
+static unsigned long ring_dropped(void)
+{
+	unsigned long dropped = 0;
+	int i;
+
+	for (i = 0; i < n_devices; i++)
+		if (devices[i].ring)
+			dropped += devices[i].ring->dropped;
+	return dropped;
+}
 
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
+/* --metrics, queue depths per device on top of the stats */
+static void write_metrics(FILE *fp)
+{
+	struct device *dev;
+	unsigned long tail;
+	int i;
+
+	stats_report_prometheus(fp, ring_dropped());
+
+	fprintf(fp, "# HELP svv_buffers Streaming buffers of the device\n"
+		"# TYPE svv_buffers gauge\n");
+	for (i = 0; i < n_devices; i++)
+		fprintf(fp, "svv_buffers{device=\"%s\"} %d\n",
+			devices[i].name,
+			__atomic_load_n(&devices[i].n_buffers,
+				__ATOMIC_RELAXED));
+
+	/* the capture threads own their devices, only their rings can be
+	looked at from here */
+	fprintf(fp, "# HELP svv_queued_frames Frames waiting to be dequeued "
+		"(driver) or displayed (ring)\n"
+		"# TYPE svv_queued_frames gauge\n");
+	for (i = 0; i < n_devices; i++) {
+		dev = &devices[i];
+		if (dev->ring) {
+			tail = __atomic_load_n(&dev->ring->tail,
+					__ATOMIC_ACQUIRE);
+			fprintf(fp, "svv_queued_frames{device=\"%s\","
+				"queue=\"ring\"} %lu\n", dev->name,
+				__atomic_load_n(&dev->ring->head,
+					__ATOMIC_ACQUIRE) - tail);
+		} else if (io != IO_METHOD_READ && !player) {
+			fprintf(fp, "svv_queued_frames{device=\"%s\","
+				"queue=\"driver\"} %u\n", dev->name,
+				count_queued_frames(dev, io));
+		}
+	}
+}
 
-	/* Timeout. */
-	tv.tv_sec = 2;
-	tv.tv_usec = 0;
+/* SIGUSR1 prints the figures so far, they are printed again on exit */
+static gboolean report_stats(gpointer data)
+{
+	stats_report(stdout, ring_dropped());
+	return TRUE;
+}
 
-	r = select(fd + 1, &fds, NULL, NULL, &tv);
-	if (r < 0) {
-		if (EINTR == errno)
-			return 0;
+static gboolean take_snapshot(gpointer data)
+{
+	snapshot_trigger(snapshot);
+	return TRUE;
+}
 
-		errno_exit("select");
+static void *capture_thread(void *data)
+{
+	struct device *dev = data;
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = dev->fd;
+	pfd.events = POLLIN;
+
+	trace_thread_name(dev->name);
+	if (low_latency)
+		lowlat_setup_thread(dev->name,
+			rt_cpu < 0 ? -1 : rt_cpu + (int)(dev - devices),
+			rt_priority);
+
+	while (__atomic_load_n(&dev->capture_running, __ATOMIC_ACQUIRE)) {
+		/* the fd is non-blocking, DQBUF fails with EAGAIN until a
+		buffer is done. Spinning saves the wakeup, not the copy */
+		if (busy_poll) {
+			if (!read_frame(dev))
+				lowlat_relax();
+			continue;
+		}
+		r = poll(&pfd, 1, 100);
+		if (r < 0) {
+			if (EINTR == errno)
+				continue;
+			errno_exit("poll");
+		}
+		if (r > 0)
+			read_frame(dev);
 	}
+	return NULL;
+}
 
-	if (0 == r) {
-		fprintf(stderr, "select timeout\n");
+static void init_threaded(struct device *dev)
+{
+	dev->ring = ring_new(RING_SLOTS, dev->buffers[0].length, drop_policy);
+	dev->ring_frame = malloc(dev->buffers[0].length);
+	if (low_latency)
+		dev->jitter = calloc(1, sizeof(*dev->jitter));
+
+	if (!dev->ring || !dev->ring_frame || (low_latency && !dev->jitter)) {
+		fprintf(stderr, "Out of memory\n");
 		exit(EXIT_FAILURE);
 	}
-#endif
-	return read_frame();
 }
 
-static void stop_capturing(void)
+static void start_capture_thread(struct device *dev)
+{
+	dev->capture_running = 1;
+	if (pthread_create(&dev->capture_tid, NULL, capture_thread, dev) != 0) {
+		fprintf(stderr, "Cannot create capture thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void stop_capture_thread(struct device *dev)
+{
+	__atomic_store_n(&dev->capture_running, 0, __ATOMIC_RELEASE);
+	ring_stop(dev->ring);
+	pthread_join(dev->capture_tid, NULL);
+
+	if (dev->ring->dropped)
+		printf("%s: ring dropped %lu frames\n", dev->name,
+			dev->ring->dropped);
+
+	if (dev->jitter) {
+		lowlat_report(stdout, dev->name, dev->jitter);
+		free(dev->jitter);
+		dev->jitter = NULL;
+	}
+
+	ring_free(dev->ring);
+	dev->ring = NULL;
+	free(dev->ring_frame);
+}
+
+static void stop_capturing(struct device *dev)
 {
 	enum v4l2_buf_type type;
 
@@ -329,23 +1112,29 @@ static void stop_capturing(void)
 	case V4L2_MEMORY_USERPTR:
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-		if (v4l2_ioctl(fd, VIDIOC_STREAMOFF, &type) < 0)
+		if (dev->source->ioctl(dev->fd, VIDIOC_STREAMOFF, &type) < 0)
 			errno_exit("VIDIOC_STREAMOFF");
 		break;
 	}
 }
 
-static void start_capturing(void)
+static int start_capturing(struct device *dev)
 {
 	int i;
 	enum v4l2_buf_type type;
 
 	switch (io) {
 	case IO_METHOD_READ:
-		/* Nothing to do. */
+		/* the first read() starts streaming, drivers and libv4l's
+		emulation alike: without it the fd never becomes readable.
+		A frame that is already there is dropped, nothing is set up
+		to show it yet */
+		if (dev->source->read(dev->fd, dev->buffers[0].start,
+				dev->buffers[0].length) < 0 && errno != EAGAIN)
+			return errno_fail("read");
 		break;
 	case V4L2_MEMORY_MMAP:
-		for (i = 0; i < n_buffers; ++i) {
+		for (i = 0; i < dev->n_buffers; ++i) {
 			struct v4l2_buffer buf;
 
 			CLEAR(buf);
@@ -354,16 +1143,16 @@ static void start_capturing(void)
 			buf.memory = V4L2_MEMORY_MMAP;
 			buf.index = i;
 
-			if (v4l2_ioctl(fd, VIDIOC_QBUF, &buf) < 0)
-				errno_exit("VIDIOC_QBUF");
+			if (dev->source->ioctl(dev->fd, VIDIOC_QBUF, &buf) < 0)
+				return errno_fail("VIDIOC_QBUF");
 		}
 
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (v4l2_ioctl(fd, VIDIOC_STREAMON, &type) < 0)
-			errno_exit("VIDIOC_STREAMON");
+		if (dev->source->ioctl(dev->fd, VIDIOC_STREAMON, &type) < 0)
+			return errno_fail("VIDIOC_STREAMON");
 		break;
 	case V4L2_MEMORY_USERPTR:
-		for (i = 0; i < n_buffers; ++i) {
+		for (i = 0; i < dev->n_buffers; ++i) {
 			struct v4l2_buffer buf;
 
 			CLEAR(buf);
@@ -371,121 +1160,128 @@ static void start_capturing(void)
 			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 			buf.memory = V4L2_MEMORY_USERPTR;
 			buf.index = i;
-			buf.m.userptr = (unsigned long) buffers[i].start;
-			buf.length = buffers[i].length;
+			buf.m.userptr = (unsigned long) dev->buffers[i].start;
+			buf.length = dev->buffers[i].length;
 
-			if (v4l2_ioctl(fd, VIDIOC_QBUF, &buf) < 0)
-				errno_exit("VIDIOC_QBUF");
+			if (dev->source->ioctl(dev->fd, VIDIOC_QBUF, &buf) < 0)
+				return errno_fail("VIDIOC_QBUF");
 		}
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-		if (v4l2_ioctl(fd, VIDIOC_STREAMON, &type) < 0)
-			errno_exit("VIDIOC_STREAMON");
+		if (dev->source->ioctl(dev->fd, VIDIOC_STREAMON, &type) < 0)
+			return errno_fail("VIDIOC_STREAMON");
 		break;
 	}
+	return 0;
 }
 
-static void uninit_device(void)
+static void uninit_device(struct device *dev)
 {
 	int i;
 
 	switch (io) {
 	case IO_METHOD_READ:
-		free(buffers[0].start);
+		free(dev->buffers[0].start);
 		break;
 	case V4L2_MEMORY_MMAP:
-		for (i = 0; i < n_buffers; ++i)
+		for (i = 0; i < dev->n_buffers; ++i)
 			if (-1 ==
-				v4l2_munmap(buffers[i].start, buffers[i].length))
+				dev->source->munmap(dev->buffers[i].start,
+					dev->buffers[i].length))
 				errno_exit("munmap");
 		break;
 	case V4L2_MEMORY_USERPTR:
-		for (i = 0; i < n_buffers; ++i)
-			free(buffers[i].start);
+		/* zero copy buffers belong to the wayland pool */
+		if (!zero_copy)
+			for (i = 0; i < dev->n_buffers; ++i)
+				free(dev->buffers[i].start);
 		break;
 	}
-	free(buffers);
+	free(dev->buffers);
 }
 
-static void init_read(unsigned int buffer_size)
+static int init_read(struct device *dev, unsigned int buffer_size)
 {
-	buffers = calloc(1, sizeof(*buffers));
+	dev->buffers = calloc(1, sizeof(*dev->buffers));
 
-	if (!buffers) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	if (!dev->buffers) {
+		fprintf(setup_err, "Out of memory\n");
+		return -1;
 	}
 
-	buffers[0].length = buffer_size;
-	buffers[0].start = malloc(buffer_size);
+	dev->buffers[0].length = buffer_size;
+	dev->buffers[0].start = malloc(buffer_size);
 
-	if (!buffers[0].start) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	if (!dev->buffers[0].start) {
+		fprintf(setup_err, "Out of memory\n");
+		return -1;
 	}
+	return 0;
 }
 
-static void init_mmap(void)
+static int init_mmap(struct device *dev)
 {
 	struct v4l2_requestbuffers req;
 
 	CLEAR(req);
 
-	req.count = 4;
+	req.count = dev->req_buffers;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
-	if (v4l2_ioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+	if (dev->source->ioctl(dev->fd, VIDIOC_REQBUFS, &req) < 0) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s does not support "
-				"memory mapping\n", dev_name);
-			exit(EXIT_FAILURE);
+			fprintf(setup_err, "%s does not support "
+				"memory mapping\n", dev->name);
+			return -1;
 		} else {
-			errno_exit("VIDIOC_REQBUFS");
+			return errno_fail("VIDIOC_REQBUFS");
 		}
 	}
 
 	if (req.count < 2) {
-		fprintf(stderr, "Insufficient buffer memory on %s\n",
-			dev_name);
-		exit(EXIT_FAILURE);
+		fprintf(setup_err, "Insufficient buffer memory on %s\n",
+			dev->name);
+		return -1;
 	}
 
-	buffers = calloc(req.count, sizeof(*buffers));
+	dev->buffers = calloc(req.count, sizeof(*dev->buffers));
 
-	if (!buffers) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	if (!dev->buffers) {
+		fprintf(setup_err, "Out of memory\n");
+		return -1;
 	}
 
-	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+	for (dev->n_buffers = 0; dev->n_buffers < req.count;
+			++dev->n_buffers) {
 		struct v4l2_buffer buf;
 
 		CLEAR(buf);
 
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = n_buffers;
+		buf.index = dev->n_buffers;
 
-		if (v4l2_ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0)
-			errno_exit("VIDIOC_QUERYBUF");
+		if (dev->source->ioctl(dev->fd, VIDIOC_QUERYBUF, &buf) < 0)
+			return errno_fail("VIDIOC_QUERYBUF");
 
-		buffers[n_buffers].length = buf.length;
-		buffers[n_buffers].start = v4l2_mmap(
+		dev->buffers[dev->n_buffers].length = buf.length;
+		dev->buffers[dev->n_buffers].start = dev->source->mmap(
 						NULL /* start anywhere */ ,
 						buf.length,
 						PROT_READ | PROT_WRITE
 						/* required */ ,
 						MAP_SHARED
 						/* recommended */ ,
-						fd, buf.m.offset);
+						dev->fd, buf.m.offset);
 
-		if (MAP_FAILED == buffers[n_buffers].start)
-			errno_exit("mmap");
+		if (MAP_FAILED == dev->buffers[dev->n_buffers].start)
+			return errno_fail("mmap");
 	}
+	return 0;
 }
 
-static void init_userp(unsigned int buffer_size)
+static int init_userp(struct device *dev, unsigned int buffer_size)
 {
 	struct v4l2_requestbuffers req;
 	unsigned int page_size;
@@ -495,73 +1291,287 @@ static void init_userp(unsigned int buffer_size)
 
 	CLEAR(req);
 
-	req.count = 4;
+	req.count = dev->req_buffers;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_USERPTR;
 
-	if (v4l2_ioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+	if (dev->source->ioctl(dev->fd, VIDIOC_REQBUFS, &req) < 0) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s does not support "
-				"user pointer i/o\n", dev_name);
-			exit(EXIT_FAILURE);
+			fprintf(setup_err, "%s does not support "
+				"user pointer i/o\n", dev->name);
+			return -1;
 		} else {
-			errno_exit("VIDIOC_REQBUFS");
+			return errno_fail("VIDIOC_REQBUFS");
 		}
 	}
 
-	buffers = calloc(4, sizeof(*buffers));
-	if (!buffers) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	if (req.count < 2) {
+		fprintf(setup_err, "Insufficient buffer memory on %s\n",
+			dev->name);
+		return -1;
+	}
+
+	dev->buffers = calloc(req.count, sizeof(*dev->buffers));
+	if (!dev->buffers) {
+		fprintf(setup_err, "Out of memory\n");
+		return -1;
 	}
 
-	for (n_buffers = 0; n_buffers < 4; ++n_buffers) {
-		buffers[n_buffers].length = buffer_size;
-		buffers[n_buffers].start = memalign( /* boundary */ page_size,
+#ifdef HAVE_WAYLAND
+	if (zero_copy) {
+		unsigned char *pool;
+
+		pool = wayland_backend_alloc_pool(req.count, buffer_size,
+				&dev->fmt.fmt.pix, requeue_userptr);
+		if (!pool) {
+			fprintf(setup_err, "Cannot allocate wayland buffer "
+				"pool\n");
+			return -1;
+		}
+		for (dev->n_buffers = 0; dev->n_buffers < req.count;
+				++dev->n_buffers) {
+			dev->buffers[dev->n_buffers].length = buffer_size;
+			dev->buffers[dev->n_buffers].start =
+				pool + dev->n_buffers * buffer_size;
+		}
+		return 0;
+	}
+#endif
+
+	for (dev->n_buffers = 0; dev->n_buffers < req.count;
+			++dev->n_buffers) {
+		dev->buffers[dev->n_buffers].length = buffer_size;
+		dev->buffers[dev->n_buffers].start = memalign(
+							/* boundary */ page_size,
 							buffer_size);
 
-		if (!buffers[n_buffers].start) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
+		if (!dev->buffers[dev->n_buffers].start) {
+			fprintf(setup_err, "Out of memory\n");
+			return -1;
 		}
 	}
+	return 0;
 }
 
-static void init_device(int w, int h)
+/* What negotiation weighs a native format by. Those svv cannot convert
+itself go through libv4l, which decodes them to RGB24 first */
+static unsigned int format_cost(__u32 pixelformat, void *data)
+{
+	struct device *dev = data;
+	int convert = gui_update_function != gui_none_update;
+
+#ifdef HAVE_WAYLAND
+	if (zero_copy && wayland_backend_has_format(pixelformat))
+		return 0;
+#endif
+	if (conv_supported(pixelformat))
+		return conv_cost(pixelformat, convert);
+	if (dev->source->is_v4l2)
+		return LIBV4L_DECODE_COST
+			+ conv_cost(V4L2_PIX_FMT_RGB24, convert);
+	return UINT_MAX;
+}
+
+/* Picks the native mode nearest w x h with the highest frame rate and the
+cheapest path to the display. Returns the format to ask for, and the
+frame interval to set or 0/0 */
+static unsigned int negotiate_format(struct device *dev, int use_cache,
+		int *w, int *h, struct v4l2_fract *interval, int *cached)
+{
+	const struct probe_mode *mode;
+	struct probe probe;
+	unsigned int want = V4L2_PIX_FMT_RGB24;
+	unsigned int mw = *w, mh = *h;
+
+	CLEAR(*interval);
+	*cached = 0;
+	if (probe_device(&probe, dev->source, dev->fd, dev->name,
+				use_cache) < 0) {
+		fprintf(setup_err, "%s: cannot probe the formats, using "
+			"rgb24\n", dev->name);
+		return want;
+	}
+
+	mode = probe_choose(&probe, &mw, &mh, format_cost, dev);
+	fprintf(setup_out, "\tprobe:\t%u modes%s\n", probe.n_modes,
+		probe.cached ? " (cached)" : "");
+	if (mode) {
+		/* libv4l decodes the rest from the chosen native format */
+		if (conv_supported(mode->pixelformat))
+			want = mode->pixelformat;
+		*w = mw;
+		*h = mh;
+		*interval = mode->interval;
+		fprintf(setup_out, "\tchosen:\t%.4s %ux%u",
+			(char *) &mode->pixelformat, mw, mh);
+		if (interval->numerator)
+			fprintf(setup_out, " @ %.1f fps",
+				(double) interval->denominator
+				/ interval->numerator);
+		fprintf(setup_out, ", cost %u\n",
+			format_cost(mode->pixelformat, dev));
+	}
+	*cached = probe.cached;
+	probe_free(&probe);
+	return want;
+}
+
+/* Reallocates the streaming buffers with a new queue depth */
+static void resize_queue(struct device *dev, unsigned int count)
+{
+	int ret = 0;
+
+	stop_capturing(dev);
+	uninit_device(dev);
+
+	dev->req_buffers = count;
+	switch (io) {
+	case V4L2_MEMORY_MMAP:
+		ret = init_mmap(dev);
+		break;
+	case V4L2_MEMORY_USERPTR:
+		ret = init_userp(dev, dev->fmt.fmt.pix.sizeimage);
+		break;
+	}
+	if (ret < 0)
+		exit(EXIT_FAILURE);
+
+	dev->adapt.have_sequence = 0;
+	if (start_capturing(dev) < 0)
+		exit(EXIT_FAILURE);
+}
+
+static int print_libv4l_conversion(struct device *dev)
 {
 	struct v4lconvert_data *v4lconvert_data;
 	struct v4l2_format src_fmt;	 /* raw source format */
+
+	v4lconvert_data = v4lconvert_create(dev->fd);
+	if (v4lconvert_data == NULL)
+		return errno_fail("v4lconvert_create");
+	if (v4lconvert_try_format(v4lconvert_data, &dev->fmt, &src_fmt) != 0)
+		return errno_fail("v4lconvert_try_format");
+
+	fprintf(setup_out, "\tpixfmt:\t%c%c%c%c (%dx%d)\n",
+		src_fmt.fmt.pix.pixelformat & 0xff,
+		(src_fmt.fmt.pix.pixelformat >> 8) & 0xff,
+		(src_fmt.fmt.pix.pixelformat >> 16) & 0xff,
+		(src_fmt.fmt.pix.pixelformat >> 24) & 0xff,
+		src_fmt.fmt.pix.width, src_fmt.fmt.pix.height);
+
+	dev->libv4l_convert = v4lconvert_needs_conversion(v4lconvert_data,
+			&src_fmt, &dev->fmt);
+	fprintf(setup_out, "application\n\tconv:\t%c\n",
+		dev->libv4l_convert ? 'Y' : 'N');
+
+	v4lconvert_destroy(v4lconvert_data);
+	return 0;
+}
+
+/* 1 / fps as a fraction, to the millihertz */
+static struct v4l2_fract fps_interval(double fps)
+{
+	struct v4l2_fract f;
+	__u32 a, b, t;
+
+	f.numerator = 1000;
+	f.denominator = fps * 1000 + 0.5;
+	for (a = f.numerator, b = f.denominator; b; a = b, b = t)
+		t = a % b;
+	f.numerator /= a;
+	f.denominator /= a;
+	return f;
+}
+
+/* Asks for interval when it is not 0/0, then decimates down to --fps in
+software if the driver still runs faster */
+static void set_frame_rate(struct device *dev,
+		const struct v4l2_fract *interval)
+{
+	struct v4l2_streamparm parm;
+	struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+	double actual = 0;
+
+	CLEAR(parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (dev->source->ioctl(dev->fd, VIDIOC_G_PARM, &parm) < 0)
+		CLEAR(parm.parm);
+
+	if ((parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)
+			&& interval->numerator && interval->denominator) {
+		*tpf = *interval;
+		if (dev->source->ioctl(dev->fd, VIDIOC_S_PARM, &parm) < 0) {
+			fprintf(setup_err, "VIDIOC_S_PARM: %s\n",
+				strerror(errno));
+			CLEAR(parm.parm);
+			dev->source->ioctl(dev->fd, VIDIOC_G_PARM, &parm);
+		}
+	}
+	if (tpf->numerator && tpf->denominator)
+		actual = (double) tpf->denominator / tpf->numerator;
+
+	if (actual)
+		fprintf(setup_out, "\tfps:\t%.1f", actual);
+	else
+		fprintf(setup_out, "\tfps:\tunknown");
+
+	/* a driver that does not tell may be faster than asked, the
+	decimation then keeps the rate */
+	if (frame_rate && (!actual
+				|| actual > frame_rate * DECIMATE_TOLERANCE)) {
+		dev->decimate_ns = 1e9 / frame_rate;
+		fprintf(setup_out, ", decimated to %.1f", frame_rate);
+	}
+	fprintf(setup_out, "\n");
+}
+
+static int init_device(struct device *dev, int w, int h)
+{
 	struct v4l2_capability cap;
+	struct v4l2_fract interval;
+	unsigned int want = pixelformat;
+	int use_cache = !reprobe, cached = 0;
+	int req_w = w, req_h = h, ret = 0;
 
-	if (v4l2_ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
+	if (dev->source->ioctl(dev->fd, VIDIOC_QUERYCAP, &cap) < 0) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s is no V4L2 device\n",
-				dev_name);
-			exit(EXIT_FAILURE);
+			fprintf(setup_err, "%s is no V4L2 device\n",
+				dev->name);
+			return -1;
 		} else {
-			errno_exit("VIDIOC_QUERYCAP");
+			return errno_fail("VIDIOC_QUERYCAP");
 		}
 	}
 
 	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-		fprintf(stderr, "%s is no video capture device\n",
-			dev_name);
-		exit(EXIT_FAILURE);
+		fprintf(setup_err, "%s is no video capture device\n",
+			dev->name);
+		return -1;
 	}
 
 	/* libv4l emulates read() on those v4l2 devices that do not support
 	it, so this print is just instructional, it should work regardless */
-	printf("device capabilities\n\tread:\t%c\n\tstream:\t%c\n",
+	fprintf(setup_out, "device capabilities\n\tread:\t%c\n"
+		"\tstream:\t%c\n",
 		(cap.capabilities & V4L2_CAP_READWRITE) ? 'Y' : 'N',
 		(cap.capabilities & V4L2_CAP_STREAMING) ? 'Y' : 'N');
 
-	/* set our requested format to V4L2_PIX_FMT_RGB24 */
-	CLEAR(fmt);
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = w;
-	fmt.fmt.pix.height = h;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
-	fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+negotiate:
+	CLEAR(interval);
+	w = req_w;
+	h = req_h;
+	if (pixelformat == PIXFMT_NATIVE)
+		want = negotiate_format(dev, use_cache, &w, &h, &interval,
+				&cached);
+
+	/* set our requested format, V4L2_PIX_FMT_RGB24 unless a YUV format was
+	asked for, which the display backends then convert in a single pass */
+	CLEAR(dev->fmt);
+	dev->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	dev->fmt.fmt.pix.width = w;
+	dev->fmt.fmt.pix.height = h;
+	dev->fmt.fmt.pix.pixelformat = want;
+	dev->fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
 
 	/* libv4l also converts mutiple supported formats to V4l2_PIX_FMT_BGR24 or
 	V4l2_PIX_FMT_YUV420, which means the following call should *always*
@@ -569,80 +1579,190 @@ static void init_device(int w, int h)
 
 	However, we use the libv4lconvert library to print debugging information
 	to tell us if libv4l will be doing the conversion internally*/
-	v4lconvert_data = v4lconvert_create(fd);
-	if (v4lconvert_data == NULL)
-		errno_exit("v4lconvert_create");
-	if (v4lconvert_try_format(v4lconvert_data, &fmt, &src_fmt) != 0)
-		errno_exit("v4lconvert_try_format");
+	if (dev->source->is_v4l2 && print_libv4l_conversion(dev) < 0)
+		return -1;
 
-	printf("\tpixfmt:\t%c%c%c%c (%dx%d)\n",
-		src_fmt.fmt.pix.pixelformat & 0xff,
-		(src_fmt.fmt.pix.pixelformat >> 8) & 0xff,
-		(src_fmt.fmt.pix.pixelformat >> 16) & 0xff,
-		(src_fmt.fmt.pix.pixelformat >> 24) & 0xff,
-		src_fmt.fmt.pix.width, src_fmt.fmt.pix.height);
+	/* Actually set the pixfmt so that libv4l uses its conversion magic */
+	if (dev->source->ioctl(dev->fd, VIDIOC_S_FMT, &dev->fmt) < 0)
+		return errno_fail("VIDIOC_S_FMT");
+
+	if (cached && (dev->fmt.fmt.pix.pixelformat != want
+				|| dev->fmt.fmt.pix.width != (__u32) w
+				|| dev->fmt.fmt.pix.height != (__u32) h)) {
+		/* enumerated again, which rewrites the cache */
+		fprintf(setup_out, "\tprobe:\tcache is stale\n");
+		use_cache = 0;
+		goto negotiate;
+	}
 
-	printf("application\n\tconv:\t%c\n",
-		v4lconvert_needs_conversion(v4lconvert_data,
-			&src_fmt,
-			&fmt) ? 'Y' : 'N');
+	if (dev->fmt.fmt.pix.pixelformat != want) {
+		fprintf(setup_err, "%s does not support the requested "
+			"format\n", dev->name);
+		return -1;
+	}
 
-	v4lconvert_destroy(v4lconvert_data);
+	/* --fps, or else the fastest rate the chosen mode offers */
+	if (frame_rate)
+		interval = fps_interval(frame_rate);
+	set_frame_rate(dev, &interval);
 
-	/* Actually set the pixfmt so that libv4l uses its conversion magic */
-	if (v4l2_ioctl(fd, VIDIOC_S_FMT, &fmt) < 0)
-		errno_exit("VIDIOC_S_FMT");
+#ifdef HAVE_WAYLAND
+	if (zero_copy && !wayland_backend_has_format(
+				dev->fmt.fmt.pix.pixelformat)) {
+		fprintf(setup_out, "\tzero copy:\tN (compositor lacks the "
+			"format)\n");
+		zero_copy = 0;
+	}
+#endif
 
-	printf("\tpixfmt:\t%c%c%c%c (%dx%d)\n",
-		fmt.fmt.pix.pixelformat & 0xff,
-		(fmt.fmt.pix.pixelformat >> 8) & 0xff,
-		(fmt.fmt.pix.pixelformat >> 16) & 0xff,
-		(fmt.fmt.pix.pixelformat >> 24) & 0xff,
-		fmt.fmt.pix.width, fmt.fmt.pix.height);
+	fprintf(setup_out, "\tpixfmt:\t%c%c%c%c (%dx%d)\n",
+		dev->fmt.fmt.pix.pixelformat & 0xff,
+		(dev->fmt.fmt.pix.pixelformat >> 8) & 0xff,
+		(dev->fmt.fmt.pix.pixelformat >> 16) & 0xff,
+		(dev->fmt.fmt.pix.pixelformat >> 24) & 0xff,
+		dev->fmt.fmt.pix.width, dev->fmt.fmt.pix.height);
 
 	switch (io) {
 	case IO_METHOD_READ:
-		printf("\tio:\tread\n");
-		init_read(fmt.fmt.pix.sizeimage);
+		fprintf(setup_out, "\tio:\tread\n");
+		ret = init_read(dev, dev->fmt.fmt.pix.sizeimage);
 		break;
 	case V4L2_MEMORY_MMAP:
-		printf("\tio:\tmmap\n");
-		init_mmap();
+		fprintf(setup_out, "\tio:\tmmap\n");
+		ret = init_mmap(dev);
 		break;
 	case V4L2_MEMORY_USERPTR:
-		printf("\tio:\tusrptr\n");
-		init_userp(fmt.fmt.pix.sizeimage);
+		fprintf(setup_out, "\tio:\tusrptr\n");
+		ret = init_userp(dev, dev->fmt.fmt.pix.sizeimage);
 		break;
 	}
+	if (ret < 0)
+		return -1;
+
+	if (io != IO_METHOD_READ)
+		fprintf(setup_out, "\tbuffers:\t%d%s\n", dev->n_buffers,
+			dev->adapt.enabled ? " (adaptive)" : "");
+	return 0;
 }
 
-static void close_device(void)
+static void close_device(struct device *dev)
 {
-	v4l2_close(fd);
+	dev->source->close(dev->fd);
 }
 
-static int open_device(void)
+static int open_device(struct device *dev)
 {
 	struct stat st;
 
-	if (stat(dev_name, &st) < 0) {
-		fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-			dev_name, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+	dev->source = source_for_device(dev->name);
+
+	/* emulated sources are not device nodes */
+	if (dev->source->is_v4l2 && stat(dev->name, &st) < 0) {
+		fprintf(setup_err, "Cannot identify '%s': %d, %s\n",
+			dev->name, errno, strerror(errno));
+		return -1;
+	}
+
+	if (dev->source->is_v4l2 && !S_ISCHR(st.st_mode)) {
+		fprintf(setup_err, "%s is no device\n", dev->name);
+		return -1;
+	}
+
+	dev->fd = dev->source->open(dev->name,
+			O_RDWR /* required */  | O_NONBLOCK);
+	if (dev->fd < 0) {
+		fprintf(setup_err, "Cannot open '%s': %d, %s\n",
+			dev->name, errno, strerror(errno));
+		return -1;
 	}
+	return dev->fd;
+}
+
+static void play_frame(unsigned char *p, int len,
+		const struct frame_info *info)
+{
+	if (recorder)
+		recorder_push(recorder, p, len, info);
+	if (snapshot)
+		snapshot_push(snapshot, p, len, info);
+	if (publisher)
+		publisher_push(publisher, p, len, info);
+	process_image(p, len, info);
+}
+
+static void play_done(void)
+{
+	g_main_loop_quit(loop);
+}
+
+static void open_player(void)
+{
+	player = player_open(play_path, play_speed, play_start);
+	if (!player)
+		exit(EXIT_FAILURE);
 
-	if (!S_ISCHR(st.st_mode)) {
-		fprintf(stderr, "%s is no device\n", dev_name);
+	CLEAR(fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix = *player_format(player);
+
+	if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_RGB24
+			&& !conv_supported(fmt.fmt.pix.pixelformat)) {
+		fprintf(stderr, "%s: cannot display %.4s frames\n",
+			play_path, (char *) &fmt.fmt.pix.pixelformat);
 		exit(EXIT_FAILURE);
 	}
 
-	fd = v4l2_open(dev_name, O_RDWR /* required */  | O_NONBLOCK, 0);
-	if (fd < 0) {
-		fprintf(stderr, "Cannot open '%s': %d, %s\n",
-			dev_name, errno, strerror(errno));
+	printf("\tpixfmt:\t%c%c%c%c (%dx%d)\n",
+		fmt.fmt.pix.pixelformat & 0xff,
+		(fmt.fmt.pix.pixelformat >> 8) & 0xff,
+		(fmt.fmt.pix.pixelformat >> 16) & 0xff,
+		(fmt.fmt.pix.pixelformat >> 24) & 0xff,
+		fmt.fmt.pix.width, fmt.fmt.pix.height);
+}
+
+/* Lays the devices out on a grid of equal cells, as square as it gets */
+static void init_tiles(void)
+{
+	struct v4l2_pix_format *pix = &fmt.fmt.pix;
+	int cols, rows, cell_w = 0, cell_h = 0;
+	int i;
+
+	for (cols = 1; cols * cols < n_devices; cols++)
+		;
+	rows = (n_devices + cols - 1) / cols;
+
+	for (i = 0; i < n_devices; i++) {
+		if (!conv_supported(devices[i].fmt.fmt.pix.pixelformat)) {
+			fprintf(stderr, "%s: cannot tile this format\n",
+				devices[i].name);
+			exit(EXIT_FAILURE);
+		}
+		if (devices[i].fmt.fmt.pix.width > cell_w)
+			cell_w = devices[i].fmt.fmt.pix.width;
+		if (devices[i].fmt.fmt.pix.height > cell_h)
+			cell_h = devices[i].fmt.fmt.pix.height;
+	}
+	for (i = 0; i < n_devices; i++) {
+		devices[i].tile_x = (i % cols) * cell_w;
+		devices[i].tile_y = (i / cols) * cell_h;
+	}
+
+	CLEAR(fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	pix->width = cols * cell_w;
+	pix->height = rows * cell_h;
+	pix->pixelformat = V4L2_PIX_FMT_XBGR32;
+	pix->field = V4L2_FIELD_NONE;
+	pix->bytesperline = pix->width * 4;
+	pix->sizeimage = pix->bytesperline * pix->height;
+
+	tiles = calloc(1, pix->sizeimage);
+	if (!tiles) {
+		fprintf(stderr, "Out of memory\n");
 		exit(EXIT_FAILURE);
 	}
-	return fd;
+	printf("tiles\n\tlayout:\t%dx%d\n\tsize:\t%ux%u\n", cols, rows,
+		pix->width, pix->height);
 }
 
 static void usage(FILE * fp, int argc, char **argv)
@@ -652,37 +1772,295 @@ static void usage(FILE * fp, int argc, char **argv)
 	fprintf(fp,
 		"Usage: %s [options]\n\n"
 		"Options:\n"
-		"-d | --device name   Video device name [/dev/video0]\n"
+		"-d | --device name   Video device name [/dev/video0], repeat it to\n"
+		"                     show up to 8 devices tiled in one window\n"
+		"                     synth[@fps] generates a moving test pattern,\n"
+		"                     replay:file[@fps] loops a --record file or raw\n"
+		"                     frames\n"
 		"-s | --size          Image size <width>x<height> [640x480]\n"
+		"-f | --format        Pixel format [rgb24,yuyv,uyvy,nv12,native]\n"
+		"                     YUV formats skip libv4l and are converted once\n"
+		"                     by the UI. native (the default) picks the\n"
+		"                     device's format, size nearest -s and frame\n"
+		"                     rate that are cheapest to display\n"
+		"     --fps x         Capture x frames per second, asked of the\n"
+		"                     driver and decimated after capture when it\n"
+		"                     cannot go that slow\n"
+		"     --reprobe       Enumerate the device's formats again instead\n"
+		"                     of reading them from ~/.cache/svv\n"
 		"-g | --grab          Grab an image and exit. Synonym for --frames=1\n"
 		"-u | --ui            UI method [none,"UI_AVAIL"]\n"
 		"-h | --help          Print this message\n"
 		"-n | --frames        Do not show a window, capture n frames [100]\n"
+		"-t | --threaded      Capture on a dedicated thread\n"
+		"     --drop p        Policy when the display falls behind (threaded)\n"
+		"                     [oldest,block]\n"
+		"     --low-latency   Capture thread with locked memory, prints the\n"
+		"                     dequeue latency and jitter it achieved\n"
+		"     --busy-poll     Spin on DQBUF instead of sleeping in poll()\n"
+		"     --cpu n         Pin the capture thread to cpu n (the next\n"
+		"                     devices to n+1...)\n"
+		"     --rt-priority n Run the capture thread SCHED_FIFO at n\n"
+		"     --buffers n     Streaming buffers to queue, or 'auto' to adapt\n"
+		"                     the depth to the drops seen at runtime [4]\n"
+		"     --wl-buffers n  Wayland shm buffers, the newest frame waits in\n"
+		"                     one for the next frame callback [3]\n"
+		"     --fullscreen    Fullscreen wayland window, scaled by the\n"
+		"                     compositor\n"
+		"     --zero-copy     Capture into wayland shm buffers and display them\n"
+		"                     without copying, needs -m u -u wayland and a\n"
+		"                     format the compositor accepts (e.g. -f yuyv)\n"
+		"     --record file   Record the frames, their format and timestamps\n"
+		"                     to an indexed file, replay:file plays it back\n"
+		"     --record-buffer n\n"
+		"                     MiB queued in memory for the disk [256]\n"
+		"     --snapshot f    Save frames on SIGUSR2 or the 's' key (gtk),\n"
+		"                     encoded in the background [ppm,png,jpeg]\n"
+		"     --burst n       Save n consecutive frames per snapshot, and\n"
+		"                     one burst right away\n"
+		"     --publish name  Publish the frames in the POSIX shared memory\n"
+		"                     ring /dev/shm/name for shmframe.h readers\n"
+		"     --motion n      Display and record only frames where a tile of\n"
+		"                     an 8x8 grid changed by more than n per byte\n"
+		"                     on average, print motion start and end\n"
+		"     --metrics path  Serve Prometheus metrics over HTTP on the unix\n"
+		"                     socket path\n"
+		"     --startup-profile\n"
+		"                     Print how long each startup step took once\n"
+		"                     the first frame is displayed\n"
+		"     --trace file    Write a chrome://tracing / Perfetto timeline of\n"
+		"                     every frame's stages at exit\n"
+		"     --play file     Show a --record file instead of a device\n"
+		"     --speed x       Play at x times the recorded rate, 0 for as\n"
+		"                     fast as the display goes [1]\n"
+		"     --start n       Start playing at frame n [0]\n"
+		"     --bench         Capture -n frames with every I/O method and UI\n"
+		"                     and print fps, CPU time, latency and RSS as JSON\n"
 		"-m | --method      m Use memory mapped buffers (default)\n"
 		"                   r Use read() calls\n"
 		"                   u Use application allocated buffers\n"
 		"", argv[0]);
 }
 
-static const char short_options[] = "d:f:ghm:rn:u:";
+static const char short_options[] = "d:f:ghm:rn:s:tu:";
+
+enum {
+	OPT_DROP = 256,
+	OPT_BUFFERS,
+	OPT_ZERO_COPY,
+	OPT_BENCH,
+	OPT_RECORD,
+	OPT_RECORD_BUFFER,
+	OPT_PLAY,
+	OPT_SPEED,
+	OPT_START,
+	OPT_LOW_LATENCY,
+	OPT_BUSY_POLL,
+	OPT_CPU,
+	OPT_RT_PRIORITY,
+	OPT_WL_BUFFERS,
+	OPT_FULLSCREEN,
+	OPT_SNAPSHOT,
+	OPT_BURST,
+	OPT_MOTION,
+	OPT_METRICS,
+	OPT_TRACE,
+	OPT_PUBLISH,
+	OPT_REPROBE,
+	OPT_STARTUP_PROFILE,
+	OPT_FPS,
+};
 
 static const struct option long_options[] = {
 	{"device", required_argument, NULL, 'd'},
 	{"size", required_argument, NULL, 's'},
+	{"format", required_argument, NULL, 'f'},
 	{"ui", required_argument, NULL, 'u'},
 	{"grab", no_argument, NULL, 'g'},
 	{"help", no_argument, NULL, 'h'},
 	{"frames", required_argument, NULL, 'n'},
 	{"method", required_argument, NULL, 'm'},
+	{"threaded", no_argument, NULL, 't'},
+	{"drop", required_argument, NULL, OPT_DROP},
+	{"buffers", required_argument, NULL, OPT_BUFFERS},
+	{"zero-copy", no_argument, NULL, OPT_ZERO_COPY},
+	{"bench", no_argument, NULL, OPT_BENCH},
+	{"record", required_argument, NULL, OPT_RECORD},
+	{"record-buffer", required_argument, NULL, OPT_RECORD_BUFFER},
+	{"play", required_argument, NULL, OPT_PLAY},
+	{"speed", required_argument, NULL, OPT_SPEED},
+	{"start", required_argument, NULL, OPT_START},
+	{"low-latency", no_argument, NULL, OPT_LOW_LATENCY},
+	{"busy-poll", no_argument, NULL, OPT_BUSY_POLL},
+	{"cpu", required_argument, NULL, OPT_CPU},
+	{"rt-priority", required_argument, NULL, OPT_RT_PRIORITY},
+	{"wl-buffers", required_argument, NULL, OPT_WL_BUFFERS},
+	{"fullscreen", no_argument, NULL, OPT_FULLSCREEN},
+	{"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+	{"burst", required_argument, NULL, OPT_BURST},
+	{"motion", required_argument, NULL, OPT_MOTION},
+	{"metrics", required_argument, NULL, OPT_METRICS},
+	{"trace", required_argument, NULL, OPT_TRACE},
+	{"publish", required_argument, NULL, OPT_PUBLISH},
+	{"reprobe", no_argument, NULL, OPT_REPROBE},
+	{"startup-profile", no_argument, NULL, OPT_STARTUP_PROFILE},
+	{"fps", required_argument, NULL, OPT_FPS},
 	{}
 };
 
+static void set_ui(const char *name)
+{
+	use_wayland = 0;
+	if (strcmp(name, "none") == 0) {
+		gui_update_function = gui_none_update;
+		gui_init_function = gui_none_init;
+		gui_connect_function = gui_none_connect;
+	}
+	if (strcmp(name, "gtk") == 0) {
+#ifdef HAVE_GTK
+		gui_update_function = gui_gtk_update;
+		gui_init_function = gui_gtk_init;
+		gui_connect_function = gui_gtk_connect;
+#else
+		fprintf(stderr, "Not compiled with gtk support\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+	if (strcmp(name, "console") == 0) {
+#ifdef HAVE_CACA
+		gui_update_function = gui_console_update;
+		gui_init_function = gui_console_init;
+		gui_connect_function = gui_console_connect;
+#else
+		fprintf(stderr, "Not compiled with console support\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+	if (strcmp(name, "wayland") == 0) {
 #ifdef HAVE_WAYLAND
-static void wayland_data(GIOChannel *source, GIOCondition condition, gpointer data)
+		gui_update_function = wayland_backend_update;
+		gui_init_function = wayland_backend_init;
+		gui_connect_function = gui_wayland_connect;
+		use_wayland = 1;
+#else
+		fprintf(stderr, "Not compiled with wayland support\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+}
+
+/* Forks the benchmark runs, returns in the children only */
+static void run_bench(void)
+{
+	static const struct {
+		int io;
+		const char *name;
+	} methods[] = {
+		{ IO_METHOD_READ, "read" },
+		{ V4L2_MEMORY_MMAP, "mmap" },
+		{ V4L2_MEMORY_USERPTR, "userptr" },
+	};
+	struct bench_case cases[BENCH_MAX_CASES];
+	const struct bench_case *c;
+	int i, j, n = 0;
+
+	for (i = 0; i < G_N_ELEMENTS(methods); i++)
+		for (j = 0; j < G_N_ELEMENTS(bench_uis); j++) {
+			cases[n].io = methods[i].io;
+			cases[n].io_name = methods[i].name;
+			cases[n].ui = bench_uis[j];
+			n++;
+		}
+
+	c = bench_run(cases, n, devices[0].name, n_ui.num_frames);
+	if (!c)
+		exit(EXIT_SUCCESS);
+
+	io = c->io;
+	set_ui(c->ui);
+}
+
+/* What the setup thread was asked for and how it went */
+struct setup {
+	int             w;
+	int             h;
+	int             failed;
+	/* what setup_out and setup_err collected */
+	char            *out;
+	char            *err;
+	size_t          out_len;
+	size_t          err_len;
+};
+
+/* Opens, negotiates and starts every device. Runs on its own thread at
+startup, while the main thread connects to the display. Stops at the
+first error, main exits once it has joined the thread */
+static void *setup_devices(void *data)
+{
+	struct setup *setup = data;
+	uint64_t t;
+	int i;
+
+	trace_thread_name("setup");
+	for (i = 0; i < n_devices; i++) {
+		devices[i].req_buffers = req_buffers;
+		devices[i].adapt.enabled = adapt_enabled;
+
+		t = stats_now();
+		if (open_device(&devices[i]) < 0)
+			goto fail;
+		startup_phase("open", t);
+
+		t = stats_now();
+		if (init_device(&devices[i], setup->w, setup->h) < 0)
+			goto fail;
+		if (motion_threshold) {
+			devices[i].motion = motion_new(devices[i].name,
+					&devices[i].fmt.fmt.pix,
+					motion_threshold);
+			if (!devices[i].motion) {
+				fprintf(setup_err, "Out of memory\n");
+				goto fail;
+			}
+		}
+		startup_phase("init", t);
+
+		/* the device warms up while the window is created */
+		t = stats_now();
+		if (start_capturing(&devices[i]) < 0)
+			goto fail;
+		startup_phase("streamon", t);
+	}
+	return NULL;
+
+fail:
+	setup->failed = 1;
+	return NULL;
+}
+
+/* Main thread, after the join. Prints what the setup thread collected and
+goes back to printing directly */
+static void print_setup_output(struct setup *setup)
+{
+	fclose(setup_out);
+	fclose(setup_err);
+	setup_out = stdout;
+	setup_err = stderr;
+
+	fwrite(setup->out, 1, setup->out_len, stdout);
+	fflush(stdout);
+	fwrite(setup->err, 1, setup->err_len, stderr);
+	free(setup->out);
+	free(setup->err);
+}
+
+#ifdef HAVE_WAYLAND
+static gboolean wayland_data(GIOChannel *source, GIOCondition condition, gpointer data)
 {
 	if (condition & G_IO_IN)
 		if (wayland_backend_dispatch() < 0)
 			exit(1);
+	return TRUE;
 }
 #endif
 
@@ -690,11 +2068,20 @@ int main(int argc, char **argv)
 {
 	int w;
 	int h;
-	int bpp;
-	int use_wayland;
+	int i;
+	struct setup setup;
+	long bench_first;
+	uint64_t bench_start, t;
+	pthread_t setup_tid;
 	GIOChannel *ioc;
 	GIOChannel *iocwl;
 
+	startup_begin();
+	t = stats_now();
+
+	setup_out = stdout;
+	setup_err = stderr;
+
 	/* default to the gtk interface if available */
 	n_ui.frame = 0;
 	n_ui.num_frames = 0;
@@ -702,15 +2089,15 @@ int main(int argc, char **argv)
 #ifdef HAVE_GTK
 	gui_update_function = gui_gtk_update;
 	gui_init_function = gui_gtk_init;
+	gui_connect_function = gui_gtk_connect;
 #else
 	gui_update_function = gui_none_update;
 	gui_init_function = gui_none_init;
+	gui_connect_function = gui_none_connect;
 #endif
 
 	w = 640;
 	h = 480;
-	bpp = 24;
-	use_wayland = 0;
 	for (;;) {
 		int index;
 		int c;
@@ -724,7 +2111,12 @@ int main(int argc, char **argv)
 		case 0:	/* getopt_long() flag */
 			break;
 		case 'd':
-			dev_name = optarg;
+			if (n_devices == MAX_DEVICES) {
+				fprintf(stderr, "At most %d devices\n",
+					MAX_DEVICES);
+				exit(EXIT_FAILURE);
+			}
+			devices[n_devices++].name = optarg;
 			break;
 		case 's':
 			if (sscanf(optarg, "%dx%d", &w, &h) != 2) {
@@ -732,47 +2124,172 @@ int main(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'f':
+			if (strcmp(optarg, "rgb24") == 0) {
+				pixelformat = V4L2_PIX_FMT_RGB24;
+			} else if (strcmp(optarg, "yuyv") == 0) {
+				pixelformat = V4L2_PIX_FMT_YUYV;
+			} else if (strcmp(optarg, "uyvy") == 0) {
+				pixelformat = V4L2_PIX_FMT_UYVY;
+			} else if (strcmp(optarg, "nv12") == 0) {
+				pixelformat = V4L2_PIX_FMT_NV12;
+			} else if (strcmp(optarg, "native") == 0) {
+				pixelformat = PIXFMT_NATIVE;
+			} else {
+				fprintf(stderr, "Unknown pixel format\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'g':
 			n_ui.grab = 1;
 			break;
 		case 'u':
-			if (strcmp(optarg, "none") == 0) {
-				gui_update_function = gui_none_update;
-				gui_init_function = gui_none_init;
+			set_ui(optarg);
+			break;
+		case 'n':
+			n_ui.num_frames = strtol(optarg, NULL, 10);
+			if (n_ui.num_frames <= 0 || errno == EINVAL)
+				n_ui.num_frames = DEFAULT_NUM_FRAMES;
+			break;
+		case 't':
+			threaded = 1;
+			break;
+		case OPT_DROP:
+			if (strcmp(optarg, "oldest") == 0) {
+				drop_policy = RING_DROP_OLDEST;
+			} else if (strcmp(optarg, "block") == 0) {
+				drop_policy = RING_BLOCK;
+			} else {
+				usage(stderr, argc, argv);
+				exit(EXIT_FAILURE);
 			}
-			if (strcmp(optarg, "gtk") == 0) {
-#ifdef HAVE_GTK
-				gui_update_function = gui_gtk_update;
-				gui_init_function = gui_gtk_init;
-#else
-				fprintf(stderr, "Not compiled with gtk support\n");
+			break;
+		case OPT_BUFFERS:
+			if (strcmp(optarg, "auto") == 0) {
+				adapt_enabled = 1;
+				break;
+			}
+			req_buffers = strtol(optarg, NULL, 10);
+			if (req_buffers < 2 || req_buffers > VIDEO_MAX_FRAME) {
+				fprintf(stderr, "Buffers must be 2-%d\n",
+					VIDEO_MAX_FRAME);
 				exit(EXIT_FAILURE);
-#endif
 			}
-			if (strcmp(optarg, "console") == 0) {
-#ifdef HAVE_CACA
-				gui_update_function = gui_console_update;
-				gui_init_function = gui_console_init;
-#else
-				fprintf(stderr, "Not compiled with console support\n");
+			break;
+		case OPT_ZERO_COPY:
+			zero_copy = 1;
+			break;
+		case OPT_BENCH:
+			bench = 1;
+			break;
+		case OPT_RECORD:
+			record_path = optarg;
+			break;
+		case OPT_PLAY:
+			play_path = optarg;
+			break;
+		case OPT_TRACE:
+			if (trace_open(optarg) < 0)
+				exit(EXIT_FAILURE);
+			trace_thread_name("main");
+			break;
+		case OPT_METRICS:
+			metrics_path = optarg;
+			break;
+		case OPT_MOTION:
+			motion_threshold = strtoul(optarg, NULL, 10);
+			if (motion_threshold == 0 || motion_threshold > 255) {
+				fprintf(stderr, "Motion threshold must be "
+					"1-255\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SNAPSHOT:
+			if (snapshot_format_from_name(optarg,
+					&snapshot_format) < 0) {
+				fprintf(stderr, "Unknown snapshot format\n");
+				exit(EXIT_FAILURE);
+			}
+			snapshot_enabled = 1;
+			break;
+		case OPT_BURST:
+			snapshot_burst = strtoul(optarg, NULL, 10);
+			if (snapshot_burst == 0 || snapshot_burst > 1000) {
+				fprintf(stderr, "Burst must be 1-1000 frames\n");
+				exit(EXIT_FAILURE);
+			}
+			snapshot_enabled = snapshot_at_start = 1;
+			break;
+		case OPT_FPS:
+			frame_rate = strtod(optarg, NULL);
+			if (frame_rate <= 0 || frame_rate > 1000) {
+				fprintf(stderr, "Frame rate must be between 0 "
+					"and 1000\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_STARTUP_PROFILE:
+			startup_enable_profile();
+			break;
+		case OPT_REPROBE:
+			reprobe = 1;
+			break;
+		case OPT_PUBLISH:
+			publish_name = optarg;
+			break;
+		case OPT_SPEED:
+			play_speed = strtod(optarg, NULL);
+			if (play_speed < 0) {
+				fprintf(stderr, "Invalid playback speed\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_START:
+			play_start = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_LOW_LATENCY:
+			low_latency = 1;
+			break;
+		case OPT_BUSY_POLL:
+			low_latency = busy_poll = 1;
+			break;
+		case OPT_CPU:
+			rt_cpu = strtol(optarg, NULL, 10);
+			if (rt_cpu < 0 || rt_cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+				fprintf(stderr, "Invalid cpu\n");
+				exit(EXIT_FAILURE);
+			}
+			low_latency = 1;
+			break;
+		case OPT_RT_PRIORITY:
+			rt_priority = strtol(optarg, NULL, 10);
+			if (rt_priority < 1 || rt_priority > 99) {
+				fprintf(stderr, "Priority must be 1-99\n");
+				exit(EXIT_FAILURE);
+			}
+			low_latency = 1;
+			break;
+		case OPT_WL_BUFFERS:
+			i = strtol(optarg, NULL, 10);
+			if (i < 2 || i > 16) {
+				fprintf(stderr, "Wayland buffers must be 2-16\n");
 				exit(EXIT_FAILURE);
-#endif
 			}
-			if (strcmp(optarg, "wayland") == 0) {
 #ifdef HAVE_WAYLAND
-					gui_update_function = wayland_backend_update;
-					gui_init_function = wayland_backend_init;
-					use_wayland = 1;
-#else
-					fprintf(stderr, "Not compiled with wayland support\n");
-					exit(EXIT_FAILURE);
+			wayland_backend_set_buffers(i);
 #endif
-			}
 			break;
-		case 'n':
-			n_ui.num_frames = strtol(optarg, NULL, 10);
-			if (n_ui.num_frames <= 0 || errno == EINVAL)
-				n_ui.num_frames = DEFAULT_NUM_FRAMES;
+		case OPT_FULLSCREEN:
+#ifdef HAVE_WAYLAND
+			wayland_backend_set_fullscreen(1);
+#endif
+			break;
+		case OPT_RECORD_BUFFER:
+			record_buffer = strtoul(optarg, NULL, 10);
+			if (record_buffer == 0) {
+				fprintf(stderr, "Invalid record buffer size\n");
+				exit(EXIT_FAILURE);
+			}
 			break;
 		case 'h':
 			usage(stdout, argc, argv);
@@ -799,22 +2316,159 @@ int main(int argc, char **argv)
 		}
 	}
 
-	open_device();
-	init_device(w, h);
-	start_capturing();
+	if (n_devices == 0)
+		devices[n_devices++].name = "/dev/video0";
 
+	if (n_devices > 1) {
+		if (zero_copy || record_path || snapshot_enabled
+				|| publish_name || play_path || bench) {
+			fprintf(stderr, "Several devices cannot be combined with "
+				"--zero-copy, --record, --snapshot, --publish, "
+				"--play or --bench\n");
+			exit(EXIT_FAILURE);
+		}
+		/* every device gets its own capture thread */
+		threaded = 1;
+	}
+
+	/* the latency is measured where frames are dequeued, that is on
+	the capture thread */
+	if (low_latency)
+		threaded = 1;
+
+	if (play_path && (threaded || zero_copy || bench || frame_rate)) {
+		fprintf(stderr, "--play cannot be combined with --threaded, "
+			"--zero-copy, --bench or --fps\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (bench) {
+		if (zero_copy) {
+			fprintf(stderr, "--zero-copy cannot be benchmarked\n");
+			exit(EXIT_FAILURE);
+		}
+		if (n_ui.num_frames <= 0)
+			n_ui.num_frames = DEFAULT_NUM_FRAMES;
+		run_bench();
+	}
+
+	if (zero_copy) {
+		if (!use_wayland || io != V4L2_MEMORY_USERPTR
+				|| threaded || adapt_enabled) {
+			fprintf(stderr, "--zero-copy needs -m u -u wayland, "
+				"without --threaded or --buffers auto\n");
+			exit(EXIT_FAILURE);
+		}
+#ifdef HAVE_WAYLAND
+		/* the buffer pool is needed before the device is set up */
+		wayland_backend_connect();
+#endif
+	}
+
+	startup_phase("options", t);
+
+	if (play_path) {
+		t = stats_now();
+		open_player();
+		startup_phase("open", t);
+	} else {
+		CLEAR(setup);
+		setup.w = w;
+		setup.h = h;
+		setup_out = open_memstream(&setup.out, &setup.out_len);
+		setup_err = open_memstream(&setup.err, &setup.err_len);
+		if (!setup_out || !setup_err) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_create(&setup_tid, NULL, setup_devices, &setup) != 0) {
+			fprintf(stderr, "Cannot create setup thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* the display connection does not depend on the format */
+	t = stats_now();
+	gui_connect_function(&argc, &argv);
+	startup_phase("display", t);
+
+	if (!play_path) {
+		t = stats_now();
+		pthread_join(setup_tid, NULL);
+		startup_phase("wait setup", t);
+		print_setup_output(&setup);
+		if (setup.failed)
+			exit(EXIT_FAILURE);
+
+		if (n_devices > 1)
+			init_tiles();
+		else
+			fmt = devices[0].fmt;
+	}
+
+	/* the frames reach the compositor through wayland_backend_submit() */
+	if (zero_copy)
+		gui_update_function = gui_none_update;
+
+	if (record_path) {
+		recorder = recorder_open(record_path, record_buffer << 20,
+				&fmt.fmt.pix);
+		if (!recorder)
+			exit(EXIT_FAILURE);
+	}
+	if (snapshot_enabled) {
+		snapshot = snapshot_new(snapshot_format, snapshot_burst,
+				&fmt.fmt.pix);
+		if (!snapshot)
+			exit(EXIT_FAILURE);
+		if (snapshot_at_start)
+			snapshot_trigger(snapshot);
+	}
+	if (publish_name) {
+		publisher = publisher_open(publish_name, PUBLISH_SLOTS,
+				&fmt.fmt.pix);
+		if (!publisher)
+			exit(EXIT_FAILURE);
+	}
 	if (n_ui.num_frames > 0)
 		printf("capturing %ld frames\n", n_ui.num_frames);
 
-	get_frame();
-
-	gui_init_function(argc, argv, w, h, bpp);
+	/* the capture threads quit it from count_frame() */
+	loop = g_main_loop_new(NULL, TRUE);
 
-	ioc = g_io_channel_unix_new(fd);
-	g_io_add_watch(ioc,
-			G_IO_IN,
-			(GIOFunc)frame_ready,
-			NULL);
+	if (threaded)
+		for (i = 0; i < n_devices; i++)
+			init_threaded(&devices[i]);
+
+	/* buffers and rings are allocated, fault them in now */
+	if (low_latency)
+		lowlat_lock_memory();
+
+	t = stats_now();
+	gui_init_function(argc, argv, &fmt.fmt.pix);
+	startup_phase("window", t);
+
+	if (player) {
+		player_start(player, play_frame, play_done);
+	} else {
+		for (i = 0; i < n_devices; i++) {
+			if (threaded) {
+				ioc = g_io_channel_unix_new(
+						devices[i].ring->data_fd);
+				g_io_add_watch(ioc,
+						G_IO_IN,
+						(GIOFunc)ring_ready,
+						&devices[i]);
+				start_capture_thread(&devices[i]);
+			} else {
+				ioc = g_io_channel_unix_new(devices[i].fd);
+				g_io_add_watch(ioc,
+						G_IO_IN,
+						(GIOFunc)frame_ready,
+						&devices[i]);
+			}
+		}
+	}
 
 #ifdef HAVE_WAYLAND
 	if (use_wayland) {
@@ -829,11 +2483,46 @@ int main(int argc, char **argv)
 	}
 #endif
 
-	loop = g_main_loop_new(NULL, TRUE);
+	g_unix_signal_add(SIGUSR1, report_stats, NULL);
+	if (metrics_path && metrics_listen(metrics_path, write_metrics) < 0)
+		exit(EXIT_FAILURE);
+	if (snapshot)
+		g_unix_signal_add(SIGUSR2, take_snapshot, NULL);
+
+	bench_first = n_ui.frame;
+	bench_start = stats_now();
 	g_main_loop_run(loop);
 
-	stop_capturing();
-	uninit_device();
-	close_device();
+	if (bench)
+		bench_report(n_ui.frame - bench_first,
+			(stats_now() - bench_start) / 1e9,
+			ring_dropped());
+	report_stats(NULL);
+	metrics_close();
+
+	if (threaded)
+		for (i = 0; i < n_devices; i++)
+			stop_capture_thread(&devices[i]);
+
+	recorder_close(recorder);
+	recorder = NULL;
+	snapshot_free(snapshot);
+	snapshot = NULL;
+	publisher_close(publisher);
+	publisher = NULL;
+	trace_close();
+
+	if (player) {
+		player_close(player);
+		return 0;
+	}
+
+	for (i = 0; i < n_devices; i++) {
+		stop_capturing(&devices[i]);
+		uninit_device(&devices[i]);
+		close_device(&devices[i]);
+		motion_free(devices[i].motion);
+	}
+	free(tiles);
 	return 0;
 }
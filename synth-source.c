@@ -0,0 +1,932 @@
+/*
+ * Emulated V4L2 capture device: a moving test pattern, or frames replayed
+ * from a recording (recfile container or raw frames). Implements just
+ * enough of the V4L2 ioctl interface for svv, including read(), mmap and
+ * userptr streaming, sequence numbers and dropped frames when the
+ * application does not requeue buffers in time.
+ *
+ * The fd handed out is an epoll instance watching a timerfd (frame clock)
+ * and an eventfd (frames waiting to be dequeued), so it can be polled like
+ * a real device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
+
+#include "source.h"
+#include "recfile.h"
+
+#define SYNTH_MAX_DEVICES 16
+#define SYNTH_DEFAULT_FPS 30
+#define SYNTH_BARS 8
+#define SYNTH_MAX_SIZE 4096
+
+enum {
+	BUF_IDLE,
+	BUF_QUEUED,
+	BUF_DONE,
+};
+
+struct synth_buffer {
+	unsigned char   *mem;
+	size_t          length;
+	int             state;
+	unsigned long   order;		/* FIFO position in its state */
+	struct v4l2_buffer v4l2;	/* filled in when the frame is done */
+};
+
+struct synth_dev {
+	int             fd;		/* epoll, handed to the application */
+	int             timer_fd;
+	int             done_fd;
+	int             done_signalled;
+	unsigned int    fps;
+	struct v4l2_format fmt;
+
+	int             memory;
+	unsigned int    n_buffers;
+	size_t          buf_size;	/* page aligned sizeimage */
+	struct synth_buffer bufs[VIDEO_MAX_FRAME];
+	unsigned long   order;
+	int             streaming;
+	int             reading;
+	__u32           sequence;
+
+	/* test pattern: one row of bars, twice as wide as the image so that
+	scrolling is a single memcpy per row */
+	unsigned char   *bars;
+	unsigned char   *bars_uv;
+
+	/* replay, a container fixes the format, raw files take any */
+	struct recfile  *rec;
+	unsigned char   *file_data;
+	size_t          file_size;
+	unsigned long   file_frames;
+};
+
+static struct synth_dev *devs[SYNTH_MAX_DEVICES];
+
+static const __u32 formats[] = {
+	V4L2_PIX_FMT_RGB24,
+	V4L2_PIX_FMT_YUYV,
+	V4L2_PIX_FMT_UYVY,
+	V4L2_PIX_FMT_NV12,
+};
+
+/* white, yellow, cyan, green, magenta, red, blue, black */
+static const unsigned char bar_rgb[SYNTH_BARS][3] = {
+	{ 235, 235, 235 }, { 235, 235, 16 }, { 16, 235, 235 },
+	{ 16, 235, 16 }, { 235, 16, 235 }, { 235, 16, 16 },
+	{ 16, 16, 235 }, { 16, 16, 16 },
+};
+
+static struct synth_dev *lookup(int fd)
+{
+	int i;
+
+	for (i = 0; i < SYNTH_MAX_DEVICES; i++)
+		if (devs[i] && devs[i]->fd == fd)
+			return devs[i];
+	errno = EBADF;
+	return NULL;
+}
+
+/* A recording has the one format it was made in */
+static int has_format(struct synth_dev *d, __u32 pixelformat)
+{
+	unsigned int i;
+
+	if (d->rec)
+		return pixelformat == d->rec->hdr->pix.pixelformat;
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+		if (pixelformat == formats[i])
+			return 1;
+	return 0;
+}
+
+static void rgb_to_yuv(const unsigned char *rgb, unsigned char *yuv)
+{
+	int r = rgb[0], g = rgb[1], b = rgb[2];
+
+	yuv[0] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+	yuv[1] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+	yuv[2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+static void set_format(struct synth_dev *d, struct v4l2_pix_format *pix)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+		if (pix->pixelformat == formats[i])
+			break;
+	if (i == sizeof(formats) / sizeof(formats[0]))
+		pix->pixelformat = V4L2_PIX_FMT_RGB24;
+
+	if (pix->width < 16)
+		pix->width = 16;
+	if (pix->height < 16)
+		pix->height = 16;
+	if (pix->width > SYNTH_MAX_SIZE)
+		pix->width = SYNTH_MAX_SIZE;
+	if (pix->height > SYNTH_MAX_SIZE)
+		pix->height = SYNTH_MAX_SIZE;
+	pix->width &= ~1;
+	pix->height &= ~1;
+	pix->field = V4L2_FIELD_NONE;
+	pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
+
+	switch (pix->pixelformat) {
+	case V4L2_PIX_FMT_RGB24:
+		pix->bytesperline = pix->width * 3;
+		pix->sizeimage = pix->bytesperline * pix->height;
+		break;
+	case V4L2_PIX_FMT_NV12:
+		pix->bytesperline = pix->width;
+		pix->sizeimage = pix->width * pix->height * 3 / 2;
+		break;
+	default:
+		pix->bytesperline = pix->width * 2;
+		pix->sizeimage = pix->bytesperline * pix->height;
+		break;
+	}
+}
+
+static int build_bars(struct synth_dev *d)
+{
+	struct v4l2_pix_format *pix = &d->fmt.fmt.pix;
+	unsigned char yuv[3];
+	unsigned char *p, *uv;
+	unsigned int x, w = pix->width;
+	const unsigned char *rgb;
+
+	free(d->bars);
+	free(d->bars_uv);
+	d->bars = malloc(2 * pix->bytesperline);
+	d->bars_uv = malloc(2 * w);
+	if (!d->bars || !d->bars_uv)
+		return -1;
+
+	p = d->bars;
+	uv = d->bars_uv;
+	for (x = 0; x < 2 * w; x++) {
+		rgb = bar_rgb[((x % w) * SYNTH_BARS) / w];
+		rgb_to_yuv(rgb, yuv);
+
+		switch (pix->pixelformat) {
+		case V4L2_PIX_FMT_RGB24:
+			*p++ = rgb[0];
+			*p++ = rgb[1];
+			*p++ = rgb[2];
+			break;
+		case V4L2_PIX_FMT_YUYV:
+			*p++ = yuv[0];
+			*p++ = (x & 1) ? yuv[2] : yuv[1];
+			break;
+		case V4L2_PIX_FMT_UYVY:
+			*p++ = (x & 1) ? yuv[2] : yuv[1];
+			*p++ = yuv[0];
+			break;
+		case V4L2_PIX_FMT_NV12:
+			*p++ = yuv[0];
+			*uv++ = (x & 1) ? yuv[2] : yuv[1];
+			break;
+		}
+	}
+	return 0;
+}
+
+/* triangle wave bouncing between 0 and range */
+static unsigned int bounce(unsigned int t, unsigned int range)
+{
+	if (range == 0)
+		return 0;
+	t %= 2 * range;
+	return t < range ? t : 2 * range - t;
+}
+
+static void render_pattern(struct synth_dev *d, unsigned char *dst,
+		__u32 seq)
+{
+	struct v4l2_pix_format *pix = &d->fmt.fmt.pix;
+	unsigned int w = pix->width, h = pix->height;
+	unsigned int stride = pix->bytesperline;
+	unsigned int bpp = stride / w;
+	unsigned int shift, bx, by, bw, bh, x, y;
+	unsigned char *row;
+
+	/* the bars scroll left, a white box bounces around */
+	shift = (seq * 4) % w;
+	bw = w / 8 & ~1;
+	bh = h / 8 & ~1;
+	bx = bounce(seq * 6, w - bw) & ~1;
+	by = bounce(seq * 4, h - bh) & ~1;
+
+	for (y = 0; y < h; y++) {
+		row = dst + y * stride;
+		memcpy(row, d->bars + shift * bpp, w * bpp);
+		if (y < by || y >= by + bh)
+			continue;
+
+		switch (pix->pixelformat) {
+		case V4L2_PIX_FMT_RGB24:
+			memset(row + bx * 3, 235, bw * 3);
+			break;
+		case V4L2_PIX_FMT_YUYV:
+			for (x = bx; x < bx + bw; x++) {
+				row[x * 2] = 235;
+				row[x * 2 + 1] = 128;
+			}
+			break;
+		case V4L2_PIX_FMT_UYVY:
+			for (x = bx; x < bx + bw; x++) {
+				row[x * 2] = 128;
+				row[x * 2 + 1] = 235;
+			}
+			break;
+		case V4L2_PIX_FMT_NV12:
+			memset(row + bx, 235, bw);
+			break;
+		}
+	}
+
+	if (pix->pixelformat == V4L2_PIX_FMT_NV12) {
+		for (y = 0; y < h / 2; y++) {
+			row = dst + (h + y) * stride;
+			memcpy(row, d->bars_uv + shift, w);
+			if (y >= by / 2 && y < (by + bh) / 2)
+				memset(row + bx, 128, bw);
+		}
+	}
+}
+
+static void render(struct synth_dev *d, unsigned char *dst, size_t len,
+		__u32 seq)
+{
+	size_t size = d->fmt.fmt.pix.sizeimage;
+	const unsigned char *frame;
+
+	if (d->rec) {
+		frame = recfile_frame(d->rec, seq % d->file_frames, &size, NULL);
+		memcpy(dst, frame, len < size ? len : size);
+		return;
+	}
+
+	if (d->file_data) {
+		if (d->file_frames == 0)
+			return;
+		memcpy(dst, d->file_data + (seq % d->file_frames) * size,
+			len < size ? len : size);
+		return;
+	}
+
+	if (len < size)
+		return;
+	render_pattern(d, dst, seq);
+}
+
+static void update_done_signal(struct synth_dev *d)
+{
+	uint64_t v = 1;
+	int i, done = 0;
+
+	for (i = 0; i < d->n_buffers; i++)
+		if (d->bufs[i].state == BUF_DONE)
+			done = 1;
+
+	/* read() with fps 0 always has a frame ready */
+	if (d->reading && d->fps == 0)
+		done = 1;
+
+	if (done && !d->done_signalled) {
+		if (write(d->done_fd, &v, sizeof(v)) == sizeof(v))
+			d->done_signalled = 1;
+	} else if (!done && d->done_signalled) {
+		if (read(d->done_fd, &v, sizeof(v)) == sizeof(v))
+			d->done_signalled = 0;
+	}
+}
+
+static struct synth_buffer *oldest(struct synth_dev *d, int state)
+{
+	struct synth_buffer *b = NULL;
+	int i;
+
+	for (i = 0; i < d->n_buffers; i++)
+		if (d->bufs[i].state == state
+				&& (!b || d->bufs[i].order < b->order))
+			b = &d->bufs[i];
+	return b;
+}
+
+static uint64_t timer_expirations(struct synth_dev *d)
+{
+	uint64_t n;
+
+	if (read(d->timer_fd, &n, sizeof(n)) != sizeof(n))
+		return 0;
+	return n;
+}
+
+static void arm_timer(struct synth_dev *d, int on)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (on && d->fps) {
+		its.it_interval.tv_nsec = 1000000000 / d->fps;
+		if (d->fps == 1) {
+			its.it_interval.tv_sec = 1;
+			its.it_interval.tv_nsec = 0;
+		}
+		its.it_value = its.it_interval;
+	}
+	timerfd_settime(d->timer_fd, 0, &its, NULL);
+}
+
+/* Turns elapsed frame periods into done buffers. Periods without a queued
+buffer are lost, as with a real driver, and show up as sequence gaps */
+static void advance(struct synth_dev *d)
+{
+	struct synth_buffer *b;
+	struct timespec ts;
+	uint64_t n;
+
+	if (!d->streaming)
+		return;
+
+	if (d->fps)
+		n = timer_expirations(d);
+	else
+		n = d->n_buffers;
+
+	while (n--) {
+		b = oldest(d, BUF_QUEUED);
+		if (!b) {
+			if (d->fps)
+				d->sequence++;
+			continue;
+		}
+
+		render(d, b->mem, b->length, d->sequence);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		b->v4l2.bytesused = d->fmt.fmt.pix.sizeimage;
+		b->v4l2.sequence = d->sequence++;
+		b->v4l2.field = V4L2_FIELD_NONE;
+		b->v4l2.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		b->v4l2.timestamp.tv_sec = ts.tv_sec;
+		b->v4l2.timestamp.tv_usec = ts.tv_nsec / 1000;
+		b->state = BUF_DONE;
+		b->order = d->order++;
+	}
+	update_done_signal(d);
+}
+
+static void free_buffers(struct synth_dev *d)
+{
+	int i;
+
+	for (i = 0; i < d->n_buffers; i++)
+		if (d->memory == V4L2_MEMORY_MMAP && d->bufs[i].mem)
+			munmap(d->bufs[i].mem, d->buf_size);
+	memset(d->bufs, 0, sizeof(d->bufs));
+	d->n_buffers = 0;
+}
+
+static int reqbufs(struct synth_dev *d, struct v4l2_requestbuffers *req)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int i;
+
+	if (req->type != V4L2_BUF_TYPE_VIDEO_CAPTURE
+			|| (req->memory != V4L2_MEMORY_MMAP
+				&& req->memory != V4L2_MEMORY_USERPTR)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (d->streaming) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	free_buffers(d);
+	if (req->count > VIDEO_MAX_FRAME)
+		req->count = VIDEO_MAX_FRAME;
+
+	d->memory = req->memory;
+	d->buf_size = (d->fmt.fmt.pix.sizeimage + page - 1) & ~(page - 1);
+
+	for (i = 0; i < req->count; i++) {
+		struct synth_buffer *b = &d->bufs[i];
+
+		b->v4l2.index = i;
+		b->v4l2.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		b->v4l2.memory = req->memory;
+		if (req->memory == V4L2_MEMORY_MMAP) {
+			b->mem = mmap(NULL, d->buf_size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (b->mem == MAP_FAILED) {
+				b->mem = NULL;
+				break;
+			}
+			b->length = d->buf_size;
+		}
+	}
+	d->n_buffers = req->count = i;
+	return 0;
+}
+
+static void describe(struct synth_dev *d, struct synth_buffer *b,
+		struct v4l2_buffer *buf)
+{
+	unsigned int index = b - d->bufs;
+
+	*buf = b->v4l2;
+	buf->index = index;
+	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf->memory = d->memory;
+	buf->length = d->memory == V4L2_MEMORY_MMAP ? d->buf_size : b->length;
+	if (d->memory == V4L2_MEMORY_MMAP)
+		buf->m.offset = index * d->buf_size;
+	else
+		buf->m.userptr = (unsigned long) b->mem;
+
+	buf->flags &= ~(V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE);
+	if (b->state == BUF_QUEUED)
+		buf->flags |= V4L2_BUF_FLAG_QUEUED;
+	else if (b->state == BUF_DONE)
+		buf->flags |= V4L2_BUF_FLAG_DONE;
+}
+
+static int qbuf(struct synth_dev *d, struct v4l2_buffer *buf)
+{
+	struct synth_buffer *b;
+
+	if (buf->index >= d->n_buffers || buf->memory != d->memory) {
+		errno = EINVAL;
+		return -1;
+	}
+	b = &d->bufs[buf->index];
+	if (b->state != BUF_IDLE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (d->memory == V4L2_MEMORY_USERPTR) {
+		if (buf->length < d->fmt.fmt.pix.sizeimage) {
+			errno = EINVAL;
+			return -1;
+		}
+		b->mem = (unsigned char *) buf->m.userptr;
+		b->length = buf->length;
+	}
+
+	b->state = BUF_QUEUED;
+	b->order = d->order++;
+
+	if (d->fps == 0)
+		advance(d);
+	return 0;
+}
+
+static int dqbuf(struct synth_dev *d, struct v4l2_buffer *buf)
+{
+	struct synth_buffer *b;
+
+	if (!d->streaming) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	advance(d);
+	b = oldest(d, BUF_DONE);
+	if (!b) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	b->state = BUF_IDLE;
+	describe(d, b, buf);
+	update_done_signal(d);
+	return 0;
+}
+
+static int streamon(struct synth_dev *d, int on)
+{
+	int i;
+
+	if (on) {
+		if (!d->streaming)
+			d->sequence = 0;
+		d->streaming = 1;
+		arm_timer(d, 1);
+		advance(d);
+	} else {
+		d->streaming = 0;
+		arm_timer(d, 0);
+		timer_expirations(d);
+		for (i = 0; i < d->n_buffers; i++)
+			d->bufs[i].state = BUF_IDLE;
+		update_done_signal(d);
+	}
+	return 0;
+}
+
+static int set_fmt(struct synth_dev *d, struct v4l2_format *f, int try_only)
+{
+	if (f->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!try_only && (d->streaming || d->n_buffers)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (d->rec)
+		f->fmt.pix = d->rec->hdr->pix;
+	else
+		set_format(d, &f->fmt.pix);
+	if (try_only)
+		return 0;
+
+	if (d->file_data) {
+		d->file_frames = d->file_size / f->fmt.pix.sizeimage;
+		if (d->file_frames == 0) {
+			fprintf(stderr, "replay file holds no complete "
+				"%ux%u frame\n",
+				f->fmt.pix.width, f->fmt.pix.height);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	d->fmt = *f;
+	return build_bars(d);
+}
+
+static int synth_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct synth_dev *d = lookup(fd);
+
+	if (!d)
+		return -1;
+
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *cap = arg;
+
+		memset(cap, 0, sizeof(*cap));
+		strcpy((char *) cap->driver, "svv-synth");
+		strcpy((char *) cap->card, d->file_data || d->rec ?
+			"svv replay" : "svv test pattern");
+		strcpy((char *) cap->bus_info, "platform:svv");
+		cap->device_caps = V4L2_CAP_VIDEO_CAPTURE
+			| V4L2_CAP_READWRITE | V4L2_CAP_STREAMING;
+		cap->capabilities = cap->device_caps
+			| V4L2_CAP_DEVICE_CAPS;
+		return 0;
+	}
+	case VIDIOC_ENUM_FMT: {
+		struct v4l2_fmtdesc *desc = arg;
+
+		if (desc->index >= (d->rec ? 1 :
+				sizeof(formats) / sizeof(formats[0]))) {
+			errno = EINVAL;
+			return -1;
+		}
+		desc->flags = 0;
+		desc->pixelformat = d->rec ? d->rec->hdr->pix.pixelformat :
+			formats[desc->index];
+		snprintf((char *) desc->description,
+			sizeof(desc->description), "%.4s",
+			(char *) &desc->pixelformat);
+		return 0;
+	}
+	case VIDIOC_ENUM_FRAMESIZES: {
+		struct v4l2_frmsizeenum *fs = arg;
+
+		if (fs->index > 0 || !has_format(d, fs->pixel_format)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (d->rec) {
+			fs->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+			fs->discrete.width = d->rec->hdr->pix.width;
+			fs->discrete.height = d->rec->hdr->pix.height;
+			return 0;
+		}
+		/* what set_format() accepts */
+		fs->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+		fs->stepwise.min_width = fs->stepwise.min_height = 16;
+		fs->stepwise.max_width = SYNTH_MAX_SIZE;
+		fs->stepwise.max_height = SYNTH_MAX_SIZE;
+		fs->stepwise.step_width = fs->stepwise.step_height = 2;
+		return 0;
+	}
+	case VIDIOC_ENUM_FRAMEINTERVALS: {
+		struct v4l2_frmivalenum *iv = arg;
+
+		/* a free running source has no interval to offer */
+		if (iv->index > 0 || !d->fps
+				|| !has_format(d, iv->pixel_format)) {
+			errno = EINVAL;
+			return -1;
+		}
+		iv->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+		iv->discrete.numerator = 1;
+		iv->discrete.denominator = d->fps;
+		return 0;
+	}
+	case VIDIOC_G_FMT:
+		*(struct v4l2_format *) arg = d->fmt;
+		return 0;
+	case VIDIOC_TRY_FMT:
+		return set_fmt(d, arg, 1);
+	case VIDIOC_S_FMT:
+		return set_fmt(d, arg, 0);
+	case VIDIOC_G_PARM:
+	case VIDIOC_S_PARM: {
+		struct v4l2_streamparm *parm = arg;
+		struct v4l2_fract *tpf = &parm->parm.capture.timeperframe;
+
+		if (request == VIDIOC_S_PARM) {
+			d->fps = tpf->numerator ?
+				tpf->denominator / tpf->numerator : 0;
+			if (d->streaming || d->reading)
+				arm_timer(d, 1);
+		}
+		memset(&parm->parm, 0, sizeof(parm->parm));
+		parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+		tpf->numerator = d->fps ? 1 : 0;
+		tpf->denominator = d->fps;
+		return 0;
+	}
+	case VIDIOC_REQBUFS:
+		return reqbufs(d, arg);
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer *buf = arg;
+
+		if (buf->index >= d->n_buffers) {
+			errno = EINVAL;
+			return -1;
+		}
+		describe(d, &d->bufs[buf->index], buf);
+		return 0;
+	}
+	case VIDIOC_QBUF:
+		return qbuf(d, arg);
+	case VIDIOC_DQBUF:
+		return dqbuf(d, arg);
+	case VIDIOC_STREAMON:
+		return streamon(d, 1);
+	case VIDIOC_STREAMOFF:
+		return streamon(d, 0);
+	}
+
+	errno = ENOTTY;
+	return -1;
+}
+
+static ssize_t synth_read(int fd, void *buf, size_t len)
+{
+	struct synth_dev *d = lookup(fd);
+	size_t size;
+	uint64_t n;
+
+	if (!d)
+		return -1;
+
+	if (!d->reading) {
+		d->reading = 1;
+		d->sequence = 0;
+		arm_timer(d, 1);
+		update_done_signal(d);
+	}
+
+	n = d->fps ? timer_expirations(d) : 1;
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* only the newest frame is returned, the others were missed */
+	d->sequence += n - 1;
+	size = d->fmt.fmt.pix.sizeimage;
+	if (len > size)
+		len = size;
+	if (len == size) {
+		render(d, buf, len, d->sequence);
+	} else {
+		unsigned char *tmp = malloc(size);
+
+		if (!tmp)
+			return -1;
+		render(d, tmp, size, d->sequence);
+		memcpy(buf, tmp, len);
+		free(tmp);
+	}
+	d->sequence++;
+	return len;
+}
+
+static void *synth_mmap(void *start, size_t length, int prot, int flags,
+		int fd, int64_t offset)
+{
+	struct synth_dev *d = lookup(fd);
+	unsigned int index;
+
+	if (!d || d->memory != V4L2_MEMORY_MMAP || !d->buf_size)
+		return MAP_FAILED;
+
+	index = offset / d->buf_size;
+	if (index >= d->n_buffers || length > d->buf_size) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return d->bufs[index].mem;
+}
+
+static int synth_munmap(void *start, size_t length)
+{
+	/* buffers are released by VIDIOC_REQBUFS and close */
+	return 0;
+}
+
+static int open_replay(struct synth_dev *d, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	switch (recfile_probe(path)) {
+	case -1:
+		return -1;
+	case 1:
+		d->rec = recfile_open(path);
+		if (!d->rec)
+			return -1;
+		d->file_frames = d->rec->n_frames;
+		if (d->file_frames == 0) {
+			fprintf(stderr, "replay file holds no frames\n");
+			errno = EINVAL;
+			return -1;
+		}
+		madvise((void *) d->rec->map, d->rec->map_size,
+			MADV_SEQUENTIAL);
+		return 0;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	d->file_size = st.st_size;
+	d->file_data = mmap(NULL, d->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (d->file_data == MAP_FAILED) {
+		d->file_data = NULL;
+		return -1;
+	}
+	madvise(d->file_data, d->file_size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+static void destroy(struct synth_dev *d)
+{
+	int i;
+
+	free_buffers(d);
+	if (d->file_data)
+		munmap(d->file_data, d->file_size);
+	recfile_close(d->rec);
+	free(d->bars);
+	free(d->bars_uv);
+	if (d->timer_fd >= 0)
+		close(d->timer_fd);
+	if (d->done_fd >= 0)
+		close(d->done_fd);
+	if (d->fd >= 0)
+		close(d->fd);
+
+	for (i = 0; i < SYNTH_MAX_DEVICES; i++)
+		if (devs[i] == d)
+			devs[i] = NULL;
+	free(d);
+}
+
+static int synth_close(int fd)
+{
+	struct synth_dev *d = lookup(fd);
+
+	if (!d)
+		return -1;
+	destroy(d);
+	return 0;
+}
+
+/* "synth[@fps]" or "replay:path[@fps]" */
+static int synth_open(const char *dev_name, int flags)
+{
+	struct synth_dev *d;
+	struct epoll_event ev;
+	struct v4l2_format f;
+	char *spec, *at;
+	int i, slot = -1;
+
+	for (i = 0; i < SYNTH_MAX_DEVICES; i++)
+		if (!devs[i]) {
+			slot = i;
+			break;
+		}
+	if (slot < 0) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	d = calloc(1, sizeof(*d));
+	spec = strdup(dev_name);
+	if (!d || !spec) {
+		free(d);
+		free(spec);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	d->fps = SYNTH_DEFAULT_FPS;
+	at = strrchr(spec, '@');
+	if (at) {
+		*at = '\0';
+		d->fps = strtoul(at + 1, NULL, 10);
+	}
+
+	d->fd = epoll_create1(EPOLL_CLOEXEC);
+	d->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC);
+	d->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	devs[slot] = d;
+
+	if (d->fd < 0 || d->timer_fd < 0 || d->done_fd < 0)
+		goto err;
+
+	if (strncmp(spec, "replay:", 7) == 0 && open_replay(d, spec + 7) < 0)
+		goto err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(d->fd, EPOLL_CTL_ADD, d->timer_fd, &ev) < 0
+			|| epoll_ctl(d->fd, EPOLL_CTL_ADD, d->done_fd, &ev) < 0)
+		goto err;
+
+	memset(&f, 0, sizeof(f));
+	f.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	f.fmt.pix.width = 640;
+	f.fmt.pix.height = 480;
+	f.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
+	if (d->rec)
+		f.fmt.pix = d->rec->hdr->pix;
+	else
+		set_format(d, &f.fmt.pix);
+	d->fmt = f;
+	if (build_bars(d) < 0)
+		goto err;
+
+	free(spec);
+	return d->fd;
+
+err:
+	i = errno;
+	free(spec);
+	destroy(d);
+	errno = i;
+	return -1;
+}
+
+const struct capture_source synth_source = {
+	.name = "synth",
+	.is_v4l2 = 0,
+	.open = synth_open,
+	.close = synth_close,
+	.ioctl = synth_ioctl,
+	.read = synth_read,
+	.mmap = synth_mmap,
+	.munmap = synth_munmap,
+};
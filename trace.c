@@ -0,0 +1,165 @@
+#define _GNU_SOURCE	/* gettid */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_EVENTS (1 << 16)	/* kept per thread, ~2 MiB */
+
+struct trace_event {
+	const char      *name;
+	uint32_t        sequence;
+	uint64_t        start;
+	uint64_t        end;
+};
+
+struct trace_buffer {
+	struct trace_buffer *next;
+	pid_t           tid;
+	const char      *thread_name;
+	/* a ring of the most recent TRACE_EVENTS, n_events counts them all */
+	unsigned long   n_events;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+int trace_enabled;
+
+static FILE *trace_file;
+static struct trace_buffer *buffers;	/* every thread's, pushed with CAS */
+static __thread struct trace_buffer *local;
+
+static struct trace_buffer *local_buffer(void)
+{
+	struct trace_buffer *tb;
+
+	if (local)
+		return local;
+
+	tb = calloc(1, sizeof(*tb));
+	if (!tb)
+		return NULL;
+	tb->tid = syscall(SYS_gettid);
+
+	tb->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&buffers, &tb->next, tb, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	local = tb;
+	return tb;
+}
+
+void trace_end(const char *name, uint32_t sequence, uint64_t start)
+{
+	struct trace_buffer *tb;
+	struct trace_event *ev;
+
+	if (!start)
+		return;
+
+	tb = local_buffer();
+	if (!tb)
+		return;
+
+	/* the spike worth looking at is usually the latest one, the oldest
+	spans make room */
+	ev = &tb->events[tb->n_events++ % TRACE_EVENTS];
+	ev->name = name;
+	ev->sequence = sequence;
+	ev->start = start;
+	ev->end = stats_now();
+}
+
+/* Thread names are device paths, which may hold anything */
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if ((unsigned char) *s >= 0x20)
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+void trace_thread_name(const char *name)
+{
+	struct trace_buffer *tb;
+
+	if (!trace_enabled)
+		return;
+	tb = local_buffer();
+	if (tb)
+		tb->thread_name = name;
+}
+
+int trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		perror(path);
+		return -1;
+	}
+	trace_enabled = 1;
+	return 0;
+}
+
+void trace_close(void)
+{
+	struct trace_buffer *tb, *next;
+	struct trace_event *ev;
+	unsigned long events = 0, overwritten = 0, first, i;
+	const char *sep = "";
+	pid_t pid = getpid();
+
+	if (!trace_file)
+		return;
+	trace_enabled = 0;
+
+	fprintf(trace_file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	for (tb = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); tb; tb = next) {
+		if (tb->thread_name) {
+			fprintf(trace_file, "%s\n{\"ph\": \"M\", "
+				"\"name\": \"thread_name\", \"pid\": %d, "
+				"\"tid\": %d, \"args\": {\"name\": ",
+				sep, pid, tb->tid);
+			json_string(trace_file, tb->thread_name);
+			fprintf(trace_file, "}}");
+			sep = ",";
+		}
+		first = tb->n_events > TRACE_EVENTS
+			? tb->n_events - TRACE_EVENTS : 0;
+		for (i = first; i < tb->n_events; i++) {
+			ev = &tb->events[i % TRACE_EVENTS];
+			fprintf(trace_file, "%s\n{\"ph\": \"X\", \"name\": ",
+				sep);
+			json_string(trace_file, ev->name);
+			fprintf(trace_file, ", \"pid\": %d, \"tid\": %d, "
+				"\"ts\": %.3f, \"dur\": %.3f, "
+				"\"args\": {\"sequence\": %u}}",
+				pid, tb->tid,
+				ev->start / 1e3, (ev->end - ev->start) / 1e3,
+				ev->sequence);
+			sep = ",";
+		}
+		events += tb->n_events - first;
+		overwritten += first;
+		next = tb->next;
+		free(tb);
+	}
+	fprintf(trace_file, "\n]}\n");
+
+	if (fclose(trace_file) != 0)
+		perror("trace");
+	trace_file = NULL;
+	buffers = NULL;
+	local = NULL;
+
+	printf("trace: %lu events", events);
+	if (overwritten)
+		printf(", %lu older ones overwritten", overwritten);
+	printf("\n");
+}
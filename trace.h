@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * Per-frame timeline in the Trace Event Format (chrome://tracing,
+ * Perfetto). Every thread appends spans to its own buffer without locks,
+ * the file is written by trace_close() once the threads are done. When
+ * tracing is off a span costs a branch.
+ */
+
+extern int trace_enabled;
+
+/* Start of a span, 0 while tracing is off */
+static inline uint64_t trace_begin(void)
+{
+	return trace_enabled ? stats_now() : 0;
+}
+
+/* Ends the span started at start. name must be a string literal. Each
+thread keeps its most recent spans, older ones are overwritten */
+void trace_end(const char *name, uint32_t sequence, uint64_t start);
+
+/* Names the calling thread in the timeline, a literal or static string */
+void trace_thread_name(const char *name);
+
+/* Returns -1 if the file cannot be created */
+int trace_open(const char *path);
+
+/* Writes the file, all threads but the caller must have stopped tracing */
+void trace_close(void);
+
+#endif // TRACE_H
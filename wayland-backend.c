@@ -14,10 +14,16 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <wayland-client.h>
+#include "presentation-time-client-protocol.h"
+#include "viewporter-client-protocol.h"
 
 #include "wayland-backend.h"
+#include "convert.h"
+#include "stats.h"
+#include "trace.h"
 
 #define cm_container_of(ptr, type, member) ({					\
 	const __typeof__( ((type *)0)->member ) *__mptr = (ptr);		\
@@ -29,7 +35,14 @@ struct display {
 	struct wl_compositor *compositor;
 	struct wl_shell *shell;
 	struct wl_shm *shm;
-	uint32_t formats;
+	struct wp_presentation *presentation;
+	struct wp_viewporter *viewporter;
+	clockid_t presentation_clock;
+	/* the last presentation with a vblank counter, 0 before */
+	uint64_t last_msc;
+	uint64_t last_present_ns;
+	uint32_t formats[32];
+	int n_formats;
 
 	int display_fd;
 };
@@ -38,35 +51,100 @@ struct buffer {
 	struct wl_buffer *buffer;
 	void *shm_data;
 	int busy;
+	int index;		/* capture buffer index, -1 if we own the pixels */
+};
+
+/* Capture buffers allocated by the backend: V4L2 writes the frames into
+memory the compositor reads directly */
+struct pool {
+	void *data;
+	size_t size;
+	int n_buffers;
+	struct buffer *buffers;
 };
 
 struct window {
 	struct display *display;
 	int width, height;
+	uint32_t pixelformat;
+	int src_stride;
 	struct wl_surface *surface;
 	struct wl_shell_surface *shell_surface;
-	struct buffer buffers[2];
+	struct wp_viewport *viewport;
+	int dest_width, dest_height;	/* surface size, scaled by the compositor */
+	struct buffer *buffers;
+	int n_buffers;
 
 	struct wl_callback *callback;
 
 	int frame_ready;
+
+	/* mailbox: the newest frame, committed on the next frame callback */
+	struct buffer *pending;
+	struct frame_info pending_info;
+};
+
+/* One per commit while wp_presentation is around */
+struct presentation_feedback {
+	struct frame_info info;
+	uint64_t commit_ns;
 };
 
 static struct display *s_display;
 static struct window *s_window;
+static struct pool s_pool;
+static WaylandReleaseFunction s_release_func;
+static int s_n_buffers = 3;
+static int s_fullscreen;
 
 static void
 shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
 {
 	struct display *d = data;
 
-	d->formats |= (1 << format);
+	/* formats are fourcc codes, too large for a bitmask */
+	if (d->n_formats < sizeof(d->formats) / sizeof(d->formats[0]))
+		d->formats[d->n_formats++] = format;
+}
+
+static int
+shm_format_for_pixfmt(uint32_t pixfmt, uint32_t *format)
+{
+	switch (pixfmt) {
+	case V4L2_PIX_FMT_XBGR32:
+	case V4L2_PIX_FMT_BGR32:
+		*format = WL_SHM_FORMAT_XRGB8888;
+		return 0;
+	case V4L2_PIX_FMT_YUYV:
+		*format = WL_SHM_FORMAT_YUYV;
+		return 0;
+	case V4L2_PIX_FMT_UYVY:
+		*format = WL_SHM_FORMAT_UYVY;
+		return 0;
+	case V4L2_PIX_FMT_NV12:
+		*format = WL_SHM_FORMAT_NV12;
+		return 0;
+	}
+	return -1;
 }
 
 struct wl_shm_listener shm_listener = {
 	shm_format
 };
 
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+					  uint32_t clk_id)
+{
+	struct display *d = data;
+
+	d->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry,
 					   uint32_t id, const char *interface, uint32_t version)
@@ -85,6 +163,14 @@ registry_handle_global(void *data, struct wl_registry *registry,
 								  &wl_shm_interface, 1);
 
 		wl_shm_add_listener(d->shm, &shm_listener, d);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		d->presentation = wl_registry_bind(registry, id,
+										   &wp_presentation_interface, 1);
+		wp_presentation_add_listener(d->presentation,
+									 &presentation_listener, d);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		d->viewporter = wl_registry_bind(registry, id,
+										 &wp_viewporter_interface, 1);
 	}
 }
 
@@ -106,6 +192,9 @@ buffer_release(void *data, struct wl_buffer *buffer)
 	struct buffer *mybuf = data;
 
 	mybuf->busy = 0;
+
+	if (mybuf->index >= 0 && s_release_func)
+		s_release_func(mybuf->index);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
@@ -239,6 +328,7 @@ create_shm_buffer(struct display *display, struct buffer *buffer,
 	close(fd);
 
 	buffer->shm_data = data;
+	buffer->index = -1;
 
 	return 0;
 }
@@ -246,16 +336,21 @@ create_shm_buffer(struct display *display, struct buffer *buffer,
 static struct buffer *
 window_next_buffer(struct window *window)
 {
-	struct buffer *buffer;
-	int ret = 0;
+	struct buffer *buffer = NULL;
+	int i, ret = 0;
 
-	if (!window->buffers[0].busy) {
-		buffer = &window->buffers[0];
-	} else if (!window->buffers[1].busy) {
-		buffer = &window->buffers[1];
-	} else {
-		return NULL;
+	/* the newest frame overwrites the one still waiting */
+	if (window->pending)
+		return window->pending;
+
+	for (i = 0; i < window->n_buffers; i++) {
+		if (!window->buffers[i].busy) {
+			buffer = &window->buffers[i];
+			break;
+		}
 	}
+	if (!buffer)
+		return NULL;
 
 	if (!buffer->buffer) {
 		ret = create_shm_buffer(window->display, buffer,
@@ -284,6 +379,28 @@ static void
 handle_configure(void *data, struct wl_shell_surface *shell_surface,
 				 uint32_t edges, int32_t width, int32_t height)
 {
+	struct window *window = data;
+
+	/* buffers stay at capture size, the compositor scales them to the
+	new surface size when the next frame is committed */
+	if (!window->viewport || width <= 0 || height <= 0)
+		return;
+
+	/* the largest size of the capture's aspect ratio that fits, rather
+	than stretching to the configured one. A fullscreen surface that
+	ends up smaller is centered on black by the compositor */
+	if ((int64_t)width * window->height > (int64_t)height * window->width)
+		width = (int64_t)height * window->width / window->height;
+	else
+		height = (int64_t)width * window->height / window->width;
+	if (width < 1)
+		width = 1;
+	if (height < 1)
+		height = 1;
+
+	window->dest_width = width;
+	window->dest_height = height;
+	wp_viewport_set_destination(window->viewport, width, height);
 }
 
 static void
@@ -299,31 +416,26 @@ static const struct wl_shell_surface_listener shell_surface_listener = {
 
 static const struct wl_callback_listener frame_listener;
 
-static int
-conv_rgb24_to_rgb32(unsigned char *src, unsigned char *dest, int size_src)
-{
-	int i = 0;
-
-	for (i = 0; i < size_src; i += 3) {
-		*dest++ = *(src + 2);
-		*dest++ = *(src + 1);
-		*dest++ = *(src);
-		*dest++ = 0;
-
-		src += 3;
-	}
-}
+static void window_commit(struct window *window, struct buffer *buffer,
+						  const struct frame_info *info);
 
 static void
 handle_wayland_ready(void *data, struct wl_callback *callback, uint32_t time)
 {
 	struct window *window = data;
+	struct buffer *buffer;
 
 	window->frame_ready = 1;
 
 	if (callback)
 		wl_callback_destroy(callback);
+	window->callback = NULL;
 
+	if (window->pending) {
+		buffer = window->pending;
+		window->pending = NULL;
+		window_commit(window, buffer, &window->pending_info);
+	}
 }
 
 static const struct wl_callback_listener frame_listener = {
@@ -344,15 +456,38 @@ create_window(struct display *display, int width, int height)
 	window->width = width;
 	window->height = height;
 
+	window->buffers = calloc(s_n_buffers, sizeof(*window->buffers));
+	if (window->buffers == NULL) {
+		free(window);
+		return NULL;
+	}
+	window->n_buffers = s_n_buffers;
+
+	window->dest_width = width;
+	window->dest_height = height;
+
 	window->surface = wl_compositor_create_surface(display->compositor);
 	window->shell_surface = wl_shell_get_shell_surface(display->shell,
 													   window->surface);
 
+	if (display->viewporter)
+		window->viewport = wp_viewporter_get_viewport(display->viewporter,
+													  window->surface);
+
 	if (window->shell_surface)
 		wl_shell_surface_add_listener(window->shell_surface,
 									  &shell_surface_listener, window);
 
-	wl_shell_surface_set_toplevel(window->shell_surface);
+	/* with a viewport we size the surface to the output ourselves,
+	without one ask the compositor to scale */
+	if (s_fullscreen)
+		wl_shell_surface_set_fullscreen(window->shell_surface,
+				window->viewport ?
+				WL_SHELL_SURFACE_FULLSCREEN_METHOD_DEFAULT :
+				WL_SHELL_SURFACE_FULLSCREEN_METHOD_SCALE,
+				0, NULL);
+	else
+		wl_shell_surface_set_toplevel(window->shell_surface);
 
 	window->frame_ready = 1;
 
@@ -364,7 +499,7 @@ create_display(void)
 {
 	struct display *display;
 
-	display = malloc(sizeof *display);
+	display = calloc(1, sizeof *display);
 
 	if (display == NULL) {
 		fprintf(stderr, "Out of memory\n");
@@ -374,7 +509,6 @@ create_display(void)
 	display->display = wl_display_connect(NULL);
 	assert(display->display);
 
-	display->formats = 0;
 	display->registry = wl_display_get_registry(display->display);
 
 	display->display_fd = wl_display_get_fd(display->display);
@@ -397,12 +531,16 @@ create_display(void)
 static void
 destroy_window(struct window *window)
 {
+	if (window->viewport)
+		wp_viewport_destroy(window->viewport);
+
 	if (window->shell_surface)
 		wl_shell_surface_destroy(window->shell_surface);
 
 	if (window->surface)
 		wl_surface_destroy(window->surface);
 
+	free(window->buffers);
 	free(window);
 }
 
@@ -415,6 +553,12 @@ destroy_display(struct display *display)
 	if (display->shell)
 		wl_shell_destroy(display->shell);
 
+	if (display->presentation)
+		wp_presentation_destroy(display->presentation);
+
+	if (display->viewporter)
+		wp_viewporter_destroy(display->viewporter);
+
 	if (display->compositor)
 		wl_compositor_destroy(display->compositor);
 
@@ -432,43 +576,291 @@ display_exit(struct display *disp)
 {
 }
 
+static uint64_t
+timespec_ns(uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec)
+{
+	return (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000ULL
+		+ tv_nsec;
+}
+
+static void
+feedback_sync_output(void *data, struct wp_presentation_feedback *feedback,
+					 struct wl_output *output)
+{
+}
+
+static void
+feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+				   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+				   uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo,
+				   uint32_t flags)
+{
+	struct presentation_feedback *fb = data;
+	struct display *d = s_display;
+	uint64_t present_ns = timespec_ns(tv_sec_hi, tv_sec_lo, tv_nsec);
+	uint64_t msc = ((uint64_t)seq_hi << 32) | seq_lo;
+	uint64_t commit_msc;
+	unsigned int missed = 0;
+
+	/* commit_ns is CLOCK_MONOTONIC, a presentation time from another
+	clock tells nothing about how late the frame was */
+	if (d->presentation_clock != CLOCK_MONOTONIC) {
+		stats_mark_presented(&fb->info, 0, 0);
+		goto out;
+	}
+
+	/* committed frames make the first vblank after the commit, every one
+	they were shown past it is missed. With a vblank counter that is
+	where the commit fell after the previous presentation, counted in
+	whole refresh periods, against the counter now; without one, the
+	time from commit to presentation in refresh periods */
+	if (refresh && msc && (flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC)
+			&& d->last_msc && msc > d->last_msc) {
+		commit_msc = d->last_msc;
+		if (fb->commit_ns > d->last_present_ns)
+			commit_msc += (fb->commit_ns - d->last_present_ns)
+				/ refresh;
+		if (msc > commit_msc + 1)
+			missed = msc - commit_msc - 1;
+	} else if (refresh && present_ns > fb->commit_ns) {
+		missed = (present_ns - fb->commit_ns) / refresh;
+	}
+	if (msc && (flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC)) {
+		d->last_msc = msc;
+		d->last_present_ns = present_ns;
+	}
+
+	stats_mark_presented(&fb->info, present_ns, missed);
+out:
+	wp_presentation_feedback_destroy(feedback);
+	free(fb);
+}
+
+static void
+feedback_discarded(void *data, struct wp_presentation_feedback *feedback)
+{
+	stats_mark_discarded();
+
+	wp_presentation_feedback_destroy(feedback);
+	free(data);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+static void
+window_commit(struct window *window, struct buffer *buffer,
+			  const struct frame_info *info)
+{
+	struct presentation_feedback *fb;
+	uint64_t t = trace_begin();
+
+	wl_surface_attach(window->surface, buffer->buffer, 0, 0);
+	wl_surface_damage(window->surface,
+					  0, 0, window->dest_width, window->dest_height);
+
+	if (window->display->presentation && info) {
+		fb = malloc(sizeof(*fb));
+		if (fb) {
+			fb->info = *info;
+			fb->commit_ns = stats_now();
+			wp_presentation_feedback_add_listener(
+				wp_presentation_feedback(window->display->presentation,
+										 window->surface),
+				&feedback_listener, fb);
+		}
+	}
+
+	window->callback = wl_surface_frame(window->surface);
+	wl_callback_add_listener(window->callback, &frame_listener, window);
+	wl_surface_commit(window->surface);
+	buffer->busy = 1;
+
+	window->frame_ready = 0;
+
+	wl_display_flush(window->display->display);
+	trace_end("wl_commit", info ? info->sequence : 0, t);
+}
+
+void
+wayland_backend_connect(void)
+{
+	if (!s_display)
+		s_display = create_display();
+}
+
+int
+wayland_backend_has_format(uint32_t pixfmt)
+{
+	uint32_t format;
+	int i;
+
+	if (shm_format_for_pixfmt(pixfmt, &format) < 0)
+		return 0;
+
+	for (i = 0; i < s_display->n_formats; i++)
+		if (s_display->formats[i] == format)
+			return 1;
+	return 0;
+}
+
+void *
+wayland_backend_alloc_pool(int n, size_t size,
+						   const struct v4l2_pix_format *pix,
+						   WaylandReleaseFunction release)
+{
+	struct wl_shm_pool *pool;
+	uint32_t format;
+	int fd, i;
+
+	if (shm_format_for_pixfmt(pix->pixelformat, &format) < 0)
+		return NULL;
+
+	s_pool.buffers = calloc(n, sizeof(*s_pool.buffers));
+	if (!s_pool.buffers)
+		return NULL;
+
+	s_pool.size = n * size;
+	fd = os_create_anonymous_file(s_pool.size);
+	if (fd < 0) {
+		fprintf(stderr, "failed to create anonymous file of size %zu\n",
+				s_pool.size);
+		return NULL;
+	}
+
+	s_pool.data = mmap(NULL, s_pool.size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED, fd, 0);
+	if (s_pool.data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed %m\n");
+		close(fd);
+		return NULL;
+	}
+
+	pool = wl_shm_create_pool(s_display->shm, fd, s_pool.size);
+	for (i = 0; i < n; i++) {
+		struct buffer *buffer = &s_pool.buffers[i];
+
+		buffer->buffer = wl_shm_pool_create_buffer(pool, i * size,
+												   pix->width, pix->height,
+												   pix->bytesperline, format);
+		buffer->shm_data = (char *)s_pool.data + i * size;
+		buffer->index = i;
+		wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	s_pool.n_buffers = n;
+	s_release_func = release;
+
+	return s_pool.data;
+}
+
 void
-wayland_backend_init(int argc, char *argv[], int w, int h, int bpp)
+wayland_backend_set_buffers(int n)
 {
-	s_display = create_display();
-	s_window = create_window(s_display, w, h);
+	s_n_buffers = n;
 }
 
 void
-wayland_backend_update(unsigned char *p, int len)
+wayland_backend_set_fullscreen(int fullscreen)
 {
-	struct buffer *buffer;
+	s_fullscreen = fullscreen;
+}
 
-	if (s_window->frame_ready == 0) {
-		return;
+void
+wayland_backend_init(int argc, char *argv[],
+					 const struct v4l2_pix_format *pix)
+{
+	wayland_backend_connect();
+	s_window = create_window(s_display, pix->width, pix->height);
+	if (!s_window) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	}
+	s_window->pixelformat = pix->pixelformat;
+	s_window->src_stride = pix->bytesperline;
+
+	printf("wayland\n\tconv:\t%s\n\tbuffers:\t%d\n\tpresentation:\t%s\n"
+		   "\tviewporter:\t%s\n",
+		   conv_impl_name(), s_n_buffers,
+		   s_display->presentation ? "yes" : "no",
+		   s_display->viewporter ? "yes" : "no");
+}
+
+void
+wayland_backend_update(unsigned char *p, int len,
+					   const struct frame_info *info)
+{
+	struct buffer *buffer;
 
 	buffer = window_next_buffer(s_window);
 
 	if (!buffer) {
+		stats_mark_skipped();
 		return;
 	}
 
-	/** convert to wayland shm format */
-	conv_rgb24_to_rgb32(p, buffer->shm_data, len);
+	/** convert to wayland shm format, in one pass for YUV too */
+	if ((size_t) len < conv_frame_size(s_window->pixelformat,
+					   s_window->src_stride, s_window->height)) {
+		stats_mark_skipped();
+		return;
+	}
+	conv_frame_to_32(s_window->pixelformat,
+					 p, s_window->src_stride,
+					 buffer->shm_data, s_window->width * 4,
+					 s_window->width, s_window->height,
+					 CONV_ORDER_BGRX);
+	stats_mark_converted();
 
-	wl_surface_attach(s_window->surface, buffer->buffer, 0, 0);
-	wl_surface_damage(s_window->surface,
-					  0, 0, s_window->width, s_window->height);
+	if (s_window->pending)
+		stats_mark_replaced();
 
-	s_window->callback = wl_surface_frame(s_window->surface);
-	wl_callback_add_listener(s_window->callback, &frame_listener, s_window);
-	wl_surface_commit(s_window->surface);
-	buffer->busy = 1;
+	/* between frame callbacks the newest frame waits, older ones lose */
+	if (s_window->frame_ready == 0) {
+		s_window->pending = buffer;
+		s_window->pending_info = *info;
+		return;
+	}
+	s_window->pending = NULL;
+	window_commit(s_window, buffer, info);
+}
+
+int
+wayland_backend_submit(int index, const struct frame_info *info)
+{
+	struct buffer *buffer, *old;
+
+	/* frames can arrive before the window exists */
+	if (!s_window || index < 0 || index >= s_pool.n_buffers)
+		return 0;
+
+	buffer = &s_pool.buffers[index];
+	if (buffer->busy)
+		return 0;
+
+	/* the capture buffer waiting for the frame callback goes back to
+	the driver, this one takes its place */
+	old = s_window->pending;
+	s_window->pending = NULL;
+	if (old) {
+		stats_mark_replaced();
+		if (s_release_func)
+			s_release_func(old->index);
+	}
 
-	s_window->frame_ready = 0;
+	if (s_window->frame_ready == 0) {
+		s_window->pending = buffer;
+		s_window->pending_info = *info;
+		return 1;
+	}
 
-	wl_display_flush(s_display->display);
+	window_commit(s_window, buffer, info);
+	return 1;
 }
 
 int
@@ -1,9 +1,47 @@
 #ifndef WAYLAND_BACKEND_H
 #define WAYLAND_BACKEND_H
 
-void wayland_backend_init(int argc, char *argv[], int w, int h, int bpp);
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/videodev2.h>
 
-void wayland_backend_update(unsigned char *p, int len);
+#include "frame.h"
+
+/* Called when the compositor releases capture buffer index */
+typedef void (*WaylandReleaseFunction)(int index);
+
+/* Connects to the compositor, wayland_backend_init() does so too */
+void wayland_backend_connect(void);
+
+/* Returns 1 if the compositor can display the V4L2 format as is */
+int wayland_backend_has_format(uint32_t pixfmt);
+
+/* Allocates n capture buffers of size bytes each from one wl_shm_pool,
+size must be page aligned. Returns the base of the pool or NULL */
+void *wayland_backend_alloc_pool(int n, size_t size,
+		const struct v4l2_pix_format *pix,
+		WaylandReleaseFunction release);
+
+/* Shows pool buffer index without copying it. Returns 1 if the backend
+now holds the buffer until the release function is called, 0 if it was not
+displayed and may be requeued right away. A buffer waiting for the next
+frame callback is released as soon as a newer one is submitted */
+int wayland_backend_submit(int index, const struct frame_info *info);
+
+/* Number of shm buffers the window converts into, call before init. One
+is on screen and one holds the newest frame until the frame callback,
+more help compositors that release buffers late */
+void wayland_backend_set_buffers(int n);
+
+/* Asks for a fullscreen window, call before init. Resizing and fullscreen
+are scaled by the compositor through wp_viewporter when it has one */
+void wayland_backend_set_fullscreen(int fullscreen);
+
+void wayland_backend_init(int argc, char *argv[],
+		const struct v4l2_pix_format *pix);
+
+void wayland_backend_update(unsigned char *p, int len,
+		const struct frame_info *info);
 
 int wayland_backend_get_fd(void);
 